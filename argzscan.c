@@ -0,0 +1,208 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "argzscan.h"
+
+// The masks for a block of bytes: bit i corresponds to p[i].
+struct argzmask {
+    uint64_t nul;   // p[i] == '\0'
+    uint64_t slash; // p[i] == '/'
+};
+
+#define INLINE static inline __attribute__((always_inline))
+
+INLINE uint64_t argznul64_scalar(const char *p)
+{
+    uint64_t nul = 0;
+    for (int i = 0; i < 64; i++)
+	nul |= (uint64_t) (p[i] == '\0') << i;
+    return nul;
+}
+
+INLINE struct argzmask argzmask64_scalar(const char *p)
+{
+    struct argzmask m = { 0, 0 };
+    for (int i = 0; i < 64; i++) {
+	m.nul |= (uint64_t) (p[i] == '\0') << i;
+	m.slash |= (uint64_t) (p[i] == '/') << i;
+    }
+    return m;
+}
+
+// The last n < 64 bytes of a vector may be followed by unmapped memory,
+// so they are always scanned byte by byte.  The bits past n are clear.
+static uint64_t argznulTail(const char *p, size_t n)
+{
+    assert(n < 64);
+    uint64_t nul = 0;
+    for (size_t i = 0; i < n; i++)
+	nul |= (uint64_t) (p[i] == '\0') << i;
+    return nul;
+}
+
+static struct argzmask argzmaskTail(const char *p, size_t n)
+{
+    assert(n < 64);
+    struct argzmask m = { 0, 0 };
+    for (size_t i = 0; i < n; i++) {
+	m.nul |= (uint64_t) (p[i] == '\0') << i;
+	m.slash |= (uint64_t) (p[i] == '/') << i;
+    }
+    return m;
+}
+
+// The scanning loops, instantiated for each kind of the mask kernels.
+#define ARGZSCAN(isa, attr)						\
+attr static void argzLens_##isa(const char *argz, const char *end,	\
+				size_t n, unsigned *lens, size_t stride) \
+{									\
+    const char *s = argz;						\
+    for (const char *blk = argz; n; blk += 64) {			\
+	assert(blk < end);						\
+	size_t left = end - blk;					\
+	uint64_t nul = left >= 64 ? argznul64_##isa(blk)		\
+				  : argznulTail(blk, left);		\
+	for (; nul && n; n--) {						\
+	    const char *z = blk + __builtin_ctzll(nul);			\
+	    nul &= nul - 1;						\
+	    *lens = z - s, lens += stride;				\
+	    s = z + 1;							\
+	}								\
+    }									\
+}									\
+									\
+attr static void argzSlashes_##isa(const char *argz, const char *end,	\
+		void (*cb)(void *arg, const char *s, size_t len), void *arg) \
+{									\
+    /* The strings start right after a null byte, and the first one	\
+       starts at argz, hence the initial carry. */			\
+    uint64_t carry = 1;							\
+    for (const char *blk = argz; blk < end; blk += 64) {		\
+	size_t left = end - blk;					\
+	struct argzmask m = left >= 64 ? argzmask64_##isa(blk)		\
+				       : argzmaskTail(blk, left);	\
+	uint64_t starts = m.slash & (m.nul << 1 | carry);		\
+	carry = m.nul >> 63;						\
+	while (starts) {						\
+	    int k = __builtin_ctzll(starts);				\
+	    starts &= starts - 1;					\
+	    const char *s = blk + k;					\
+	    /* The null byte is usually in the same block. */		\
+	    uint64_t nul = m.nul >> k;					\
+	    cb(arg, s, nul ? (size_t) __builtin_ctzll(nul) : strlen(s)); \
+	}								\
+    }									\
+}
+
+ARGZSCAN(scalar, )
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE2 INLINE uint64_t argznul64_sse2(const char *p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t nul = 0;
+    for (int i = 0; i < 4; i++) {
+	__m128i x = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+	uint64_t m = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+	nul |= m << (16 * i);
+    }
+    return nul;
+}
+
+SSE2 INLINE struct argzmask argzmask64_sse2(const char *p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i slash = _mm_set1_epi8('/');
+    struct argzmask m = { 0, 0 };
+    for (int i = 0; i < 4; i++) {
+	__m128i x = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+	uint64_t nul = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+	uint64_t sl = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(x, slash));
+	m.nul |= nul << (16 * i);
+	m.slash |= sl << (16 * i);
+    }
+    return m;
+}
+
+AVX2 INLINE uint64_t argznul64_avx2(const char *p)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i x0 = _mm256_loadu_si256((const __m256i *) p);
+    __m256i x1 = _mm256_loadu_si256((const __m256i *) (p + 32));
+    uint64_t nul0 = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, zero));
+    uint64_t nul1 = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, zero));
+    return nul0 | nul1 << 32;
+}
+
+AVX2 INLINE struct argzmask argzmask64_avx2(const char *p)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i slash = _mm256_set1_epi8('/');
+    __m256i x0 = _mm256_loadu_si256((const __m256i *) p);
+    __m256i x1 = _mm256_loadu_si256((const __m256i *) (p + 32));
+    uint64_t nul0 = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, zero));
+    uint64_t nul1 = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, zero));
+    uint64_t sl0 = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, slash));
+    uint64_t sl1 = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, slash));
+    return (struct argzmask) { nul0 | nul1 << 32, sl0 | sl1 << 32 };
+}
+
+ARGZSCAN(sse2, SSE2)
+ARGZSCAN(avx2, AVX2)
+
+// The resolvers run before the constructors, hence __builtin_cpu_init.
+#define RESOLVE(func)							\
+static void *func##_resolve(void)					\
+{									\
+    __builtin_cpu_init();						\
+    if (__builtin_cpu_supports("avx2"))					\
+	return func##_avx2;						\
+    if (__builtin_cpu_supports("sse2"))					\
+	return func##_sse2;						\
+    return func##_scalar;						\
+}
+#else
+#define RESOLVE(func)							\
+static void *func##_resolve(void)					\
+{									\
+    return func##_scalar;						\
+}
+#endif
+
+RESOLVE(argzLens)
+RESOLVE(argzSlashes)
+
+void argzLens(const char *argz, const char *end, size_t n,
+	      unsigned *lens, size_t stride)
+	__attribute__((ifunc("argzLens_resolve")));
+
+void argzSlashes(const char *argz, const char *end,
+		 void (*cb)(void *arg, const char *s, size_t len), void *arg)
+	__attribute__((ifunc("argzSlashes_resolve")));
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,39 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stddef.h>
+
+// String arrays in header blobs are argz vectors, i.e. null-terminated
+// strings laid out one after another.  Instead of calling strlen on each
+// string, the vectors can be scanned 64 bytes at a time, yielding bitmasks
+// which tell where the strings end and where they start with a slash.
+// The scanning loops are compiled for AVX2, SSE2 and plain C, and the
+// best one is picked by the dynamic linker (ifunc), so that the choice
+// is made once per vector, and the mask computation is inlined.
+
+// Find the lengths of the first n strings of the vector [argz, end),
+// which must have them.  The length of string i is stored to lens[i*stride].
+// Only the null bytes are looked at.
+void argzLens(const char *argz, const char *end, size_t n,
+	      unsigned *lens, size_t stride);
+
+// Call cb for each string in [argz, end) which starts with a slash.
+void argzSlashes(const char *argz, const char *end,
+		 void (*cb)(void *arg, const char *s, size_t len), void *arg);
@@ -7,6 +7,8 @@
 #define CRPMTAG_FILESIZE          1000001
 #define CRPMTAG_MD5               1000005
 #define CRPMTAG_SHA1              1000006 // was never used
+// Not known to APT, emitted with --sha256 for the clients moving off MD5.
+#define CRPMTAG_SHA256            1000007
 
 // Package location relative to the repo, e.g. RPMS.classic or ../SRPMS.hasher.
 #define CRPMTAG_DIRECTORY         1000010
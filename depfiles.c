@@ -52,9 +52,10 @@ static inline bool bindir(const char *d, size_t dlen)
 }
 
 #include <assert.h>
+#include <pthread.h>
 #include <rpm/rpmlib.h>
 #include <t1ha.h>
-#include "fpset.h"
+#include "errexit.h" // xmalloc
 
 // The hash function which is used for fingerprinting.
 static uint64_t hash64(const void *data, size_t size, uint64_t seed)
@@ -68,15 +69,75 @@ static uint64_t hash64(const void *data, size_t size, uint64_t seed)
 // at least this can be fixed by running the program again.
 static uint64_t fpseed;
 
+// A growing array of fingerprints.
+struct fpbuf {
+    struct fpbuf *next;
+    uint64_t *fp;
+    size_t n, alloc;
+};
+
 // The set of 64-bit fingerprints of filename dependencies.  Works as
 // a probabilistic data structure for approximate membership queries.
 // In the worst case (which in a typical setting is highly unlikely)
 // an unrelated filename can be preserved in the output on behalf of
-// filename dependencies.
-static struct fpset *depFiles;
+// filename dependencies.  The set is built in two stages.  First, the
+// fingerprints are simply accumulated in depFilesBuf, duplicates and all.
+static struct fpbuf depFilesBuf;
+
+// Then, before the first query, the set is frozen into a hash table
+// of cache-line-sized buckets, so that a query takes a single cache miss
+// (the buckets are half full on average, and only a few overflow into
+// the next bucket).  Zero denotes an empty slot, therefore fingerprints
+// are made non-zero.  The table is NULL if there are no depFiles.
+#define BUCKET_FP 8
+static uint64_t (*depFiles)[BUCKET_FP];
+static size_t depFilesMask;
+static bool depFilesFrozen;
+
+// When findDepFilesB runs on behalf of a few threads, each thread collects
+// the fingerprints into its own buffer, which is later merged into depFiles.
+// The buffers are chained, so that mergeDepFiles can find them.
+
+static struct fpbuf *fpbufList;
+static pthread_mutex_t fpbufMutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct fpbuf *fpbufLocal;
+
+// Get the buffer of the current thread.
+static struct fpbuf *localFpbuf(void)
+{
+    struct fpbuf *buf = fpbufLocal;
+    if (buf)
+	return buf;
+    buf = xmalloc(sizeof *buf);
+    buf->fp = NULL;
+    buf->n = buf->alloc = 0;
+    pthread_mutex_lock(&fpbufMutex);
+    buf->next = fpbufList;
+    fpbufList = buf;
+    pthread_mutex_unlock(&fpbufMutex);
+    return fpbufLocal = buf;
+}
+
+// Add a fingerprint either to depFiles or to the buffer.
+static inline void addFp(struct fpbuf *buf, uint64_t fp)
+{
+    if (!buf) {
+	assert(!depFilesFrozen);
+	buf = &depFilesBuf;
+    }
+    if (buf->n == buf->alloc) {
+	buf->alloc = buf->alloc ? 2 * buf->alloc : 1024;
+	buf->fp = realloc(buf->fp, buf->alloc * sizeof *buf->fp);
+	if (!buf->fp)
+	    die("cannot allocate %zu bytes", buf->alloc * sizeof *buf->fp);
+    }
+    buf->fp[buf->n++] = fp;
+}
 
-// Add a filename dependency (which must start with a slash) to depFiles.
-static void addDepFile(const char *dep, size_t len)
+// Check if a filename dependency (which must start with a slash) is worth
+// adding to depFiles.  Returns the length of its dirname (including the
+// slash), or 0 if the dependency is to be skipped.
+static size_t depFileDirLen(const char *dep, size_t len)
 {
     // Check if the name ends with a close paren.  Dependencies like
     // "/etc/rc.d/init.d(status)" or "/usr/lib64/firefox/libxul.so()(64bit)"
@@ -85,27 +146,35 @@ static void addDepFile(const char *dep, size_t len)
     // of the same source package (in which case the dependency gets
     // optimized out by rpmbuild, so we'll never see it).
     if (dep[len-1] == ')')
-	return;
+	return 0;
     // Skip if it's under bindir; later the check for bindir will
-    // pick it up anyway.  This fpset data structure works best when
+    // pick it up anyway.  The depFiles table works best when
     // it has the fewest elements.
     const char *rslash = memrchr(dep, '/', len);
     size_t dlen = rslash + 1 - dep; // including the slash
     if (bindir(dep, dlen))
+	return 0;
+    return dlen;
+}
+
+// Add a filename dependency (which must start with a slash) to depFiles
+// (or to the buffer, if buf is not NULL).
+static void addDepFile(const char *dep, size_t len, struct fpbuf *buf)
+{
+    size_t dlen = depFileDirLen(dep, len);
+    if (!dlen)
 	return;
     // Add the fingerprint for the dir.  Later we check if the dir was added
     // and otherwise skip all the files under the dir.
     uint64_t fp = hash64(dep, dlen, fpseed);
-    int rc = fpset_add(depFiles, fp);
-    assert(rc >= 0);
+    addFp(buf, fp);
     // Add the fingerprint for the dir+name.  Only the filename is actually
     // hashed, while the dir hash is used as the seed.  Note that, with this
     // hashing scheme, dir and dir+name hashes fall under kind of two different
-    // domains.  We might as well use two separate fpsets, which seems redunant
+    // domains.  We might as well use two separate sets, which seems redunant
     // given that we have (at the time of writing) 2070 depfiles under 429 dirs.
     fp = hash64(dep + dlen, len - dlen, fp);
-    rc = fpset_add(depFiles, fp);
-    assert(rc >= 0);
+    addFp(buf, fp);
 }
 
 // Process filename dependencies from a specific tag.
@@ -127,7 +196,7 @@ static bool findDepFilesH1(Header h, int tag)
 	    assert(deps[i+1] > deps[i]);
 	    size_t len = deps[i+1] - deps[i] - 1;
 	    assert(deps[i][len] == '\0');
-	    addDepFile(deps[i], len);
+	    addDepFile(deps[i], len, NULL);
 	}
     // The length of the last name isn't known.  However, it is very unlikely
     // that the last name starts with a slash.  Currently the last Provides
@@ -135,19 +204,21 @@ static bool findDepFilesH1(Header h, int tag)
     // File Conflicts are uncommon and forbidden in rpmbuild 4.0.  If names
     // ever become sorted, filenames will collate before regular names.
     if (*deps[lasti] == '/')
-	addDepFile(deps[lasti], strlen(deps[lasti]));
+	addDepFile(deps[lasti], strlen(deps[lasti]), NULL);
     rpmtdFreeData(&td);
     return true;
 }
 
 #include <arpa/inet.h>
+#include "argzscan.h"
 
 // Raw header entry, network byte order.
 struct ent { int tag, type, off, cnt; };
 
 // A counterpart to findDepFilesH1 that can process raw blob entries,
 // without loading the header with headerImport().
-static void findDepFilesB1(struct ent *e, char *data, unsigned dl)
+static void findDepFilesB1(struct ent *e, char *data, unsigned dl,
+			   void (*cb)(void *arg, const char *dep, size_t len), void *arg)
 {
     // Note that htonl(const) won't require actual runtime conversion.
     // This is one reason why specialized parsing outperforms general
@@ -161,41 +232,13 @@ static void findDepFilesB1(struct ent *e, char *data, unsigned dl)
     unsigned off1 = ntohl(e[1].off);
     assert(off1 < dl);
     assert(off1 > off);
-    char *end = data + off1;
+    const char *end = data + off1;
     assert(end[-1] == '\0');
-    // Install the sentinel for rawmemchr.
-    char save = *end;
-    *end = '/';
-    // Instead of iterating each name, the loop tries to iterate only the names
-    // that start with a slash.  This is another reason why specialized parsing
-    // is much more efficient.
-    do {
-	// Iterations start at the beginning of a name.
-	if (*argz == '/') {
-	    size_t len = 1 + strlen(argz + 1);
-	    addDepFile(argz, len);
-	    argz += len + 1;
-	}
-	else {
-	    // The name doesn't start with a slash, so try to jump to a goddamn
-	    // slash.  Only about 13% of Requires+Provides names have a slash.
-	    // So this should effectively skip a few names at a time, on average.
-	    argz = rawmemchr(argz + 1, '/');
-	    if (argz == end)
-		break;
-	    size_t len = 1 + strlen(argz + 1);
-	    // Check if the slash is at the beginning of a name.
-	    if (argz[-1] == '\0')
-		addDepFile(argz, len);
-	    argz += len + 1;
-	    // When the length isn't needed for addDepFile, it might be
-	    // tempting to try and jump right to the next slash.  However,
-	    // in the presence of dependencies like "perl(Net/DNS/RR/A.pm)",
-	    // it's not a clear win.
-	}
-    } while (argz < end);
-    // Restore the byte clobbered by the sentinel.
-    *end = save;
+    // Instead of iterating each name, the scan only visits the names that
+    // start with a slash, which is another reason why specialized parsing
+    // is much more efficient.  Only about 13% of Requires+Provides names
+    // have a slash.
+    argzSlashes(argz, end, cb, arg);
 }
 
 // So far we have implemented some helpers to collect filename-like
@@ -232,20 +275,134 @@ struct dirInfoB {
     unsigned off, len;
 };
 
+// Query the frozen depFiles table.
+static inline bool depFilesHas(uint64_t fp)
+{
+    fp += !fp;
+    size_t b = fp & depFilesMask;
+    while (1) {
+	const uint64_t *slot = depFiles[b];
+	for (int i = 0; i < BUCKET_FP; i++) {
+	    if (slot[i] == fp)
+		return true;
+	    if (slot[i] == 0)
+		return false;
+	}
+	b = (b + 1) & depFilesMask;
+    }
+}
+
+// Prefetch the bucket which depFilesHas(fp) is going to probe.
+static inline void depFilesPrefetch(uint64_t fp)
+{
+    fp += !fp;
+    __builtin_prefetch(depFiles[fp & depFilesMask]);
+}
+
+// The same few thousand dirnames (such as /usr/share/doc/) recur across
+// all the packages.  Once depFiles is frozen, the classification of a dir
+// never changes, so it is cached.  The cache is a fixed-size table of
+// pointers to immutable entries.  An entry is published with a CAS into
+// an empty slot, so the cache is shared by the threads without locks.
+// When the slots run out, the dirs are simply not cached.
+struct dirCacheEnt {
+    uint64_t fp;
+    enum dirNeed need;
+    unsigned len;
+    char name[];
+};
+
+#define DIRCACHE_BITS 14
+#define DIRCACHE_PROBE 4
+static struct dirCacheEnt *dirCache[1 << DIRCACHE_BITS];
+
+// A cheap hash, which only looks at the length and a few bytes in the
+// middle and at the end: dirnames tend to share long prefixes.
+static inline size_t dirCacheHash(const char *dn, size_t dlen)
+{
+    uint64_t x = dlen, y = 0;
+    if (dlen >= 8) {
+	memcpy(&x, dn + dlen - 8, 8);
+	memcpy(&y, dn + (dlen - 8) / 2, 8);
+	x ^= dlen;
+    }
+    else {
+	for (size_t i = 0; i < dlen; i++)
+	    y = y << 8 | (unsigned char) dn[i];
+    }
+    x *= UINT64_C(0x9E3779B97F4A7C15);
+    x ^= y;
+    x *= UINT64_C(0xC2B2AE3D27D4EB4F);
+    return x >> (64 - DIRCACHE_BITS);
+}
+
+static inline const struct dirCacheEnt *dirCacheGet(size_t h, const char *dn, size_t dlen)
+{
+    for (size_t i = 0; i < DIRCACHE_PROBE; i++) {
+	size_t k = (h + i) & ((1 << DIRCACHE_BITS) - 1);
+	const struct dirCacheEnt *c = __atomic_load_n(&dirCache[k], __ATOMIC_ACQUIRE);
+	if (!c)
+	    return NULL;
+	if (c->len == dlen && memcmp(c->name, dn, dlen) == 0)
+	    return c;
+    }
+    return NULL;
+}
+
+static void dirCachePut(size_t h, const char *dn, size_t dlen,
+			enum dirNeed need, uint64_t fp)
+{
+    // Once the window is full, it stays full, so check first and
+    // do not allocate in vain.  A relaxed load is enough to see a NULL.
+    size_t i = 0;
+    for (; i < DIRCACHE_PROBE; i++) {
+	size_t k = (h + i) & ((1 << DIRCACHE_BITS) - 1);
+	if (!__atomic_load_n(&dirCache[k], __ATOMIC_RELAXED))
+	    break;
+    }
+    if (i == DIRCACHE_PROBE)
+	return;
+    struct dirCacheEnt *c = xmalloc(sizeof *c + dlen);
+    c->fp = fp, c->need = need, c->len = dlen;
+    memcpy(c->name, dn, dlen);
+    for (; i < DIRCACHE_PROBE; i++) {
+	size_t k = (h + i) & ((1 << DIRCACHE_BITS) - 1);
+	struct dirCacheEnt *old = NULL;
+	if (__atomic_compare_exchange_n(&dirCache[k], &old, c, false,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+	    return;
+	// Another thread may have just added the same dir.
+	if (old->len == dlen && memcmp(old->name, dn, dlen) == 0)
+	    break;
+    }
+    free(c);
+}
+
 // Load single dir info, header version.  Returns true if the dir is useful.
+// Must only be called after depFiles is frozen, because of the cache.
 static inline bool makeDirInfoH1(struct dirInfoH *d, const char *dn, size_t dlen)
 {
     d->dj = (unsigned) -1;
+    size_t h = dirCacheHash(dn, dlen);
+    const struct dirCacheEnt *c = dirCacheGet(h, dn, dlen);
+    if (c) {
+	d->fp = c->fp, d->need = c->need;
+	return c->need != D_SKIP;
+    }
+    enum dirNeed need = D_SKIP;
+    uint64_t fp = 0;
     if (bindir(dn, dlen))
-	return d->need = D_BIN, true;
+	need = D_BIN;
     // Note that depFiles is checked here, so there's no need to check
     // depFiles later when iterating filenames.
-    if (depFiles) {
-	uint64_t fp = hash64(dn, dlen, fpseed);
-	if (fpset_has(depFiles, fp))
-	    return d->fp = fp, d->need = D_CHECK, true;
+    else if (depFiles) {
+	fp = hash64(dn, dlen, fpseed);
+	if (depFilesHas(fp))
+	    need = D_CHECK;
     }
-    return d->need = D_SKIP, false;
+    dirCachePut(h, dn, dlen, need, fp);
+    d->fp = fp, d->need = need;
+    return need != D_SKIP;
 }
 
 // Load single dir info, header blob version.
@@ -255,11 +412,10 @@ static inline bool makeDirInfoB1(struct dirInfoB *d, const char *dn, size_t dlen
     return makeDirInfoH1((struct dirInfoH *) d, dn, dlen);
 }
 
-#include "errexit.h" // xmalloc
-
 // Most packages have only a few dirnames.
 // Preallocate a small dirInfo array, to cut down on malloc calls.
-static union { struct dirInfoH H[24]; struct dirInfoB B[16]; } dirInfoBuf;
+// The array is per thread, since stripFileList can run in parallel.
+static __thread union { struct dirInfoH H[24]; struct dirInfoB B[16]; } dirInfoBuf;
 // Should waste no memory in either case.
 static_assert(sizeof dirInfoBuf.H == sizeof dirInfoBuf.B, "dirInfoBuf size");
 
@@ -298,13 +454,13 @@ static struct dirInfoB *makeDirInfoB(struct ent *e, size_t n, char *data, unsign
     char *end = data + off1;
     assert(end[-1] == '\0');
     // Similar to makeDirInfoH.
+    argzLens(argz, end, n, &dinfo->len, sizeof *dinfo / sizeof dinfo->len);
     bool need = false;
     for (size_t i = 0; i < n; i++) {
-	assert(argz < end);
 	struct dirInfoB *d = &dinfo[i];
-	size_t len = strlen(argz);
+	size_t len = d->len;
 	need |= makeDirInfoB1(d, argz, len);
-	d->off = argz - data, d->len = len;
+	d->off = argz - data;
 	argz += len + 1;
     }
     if (!need) {
@@ -320,27 +476,135 @@ static struct dirInfoB *makeDirInfoB(struct ent *e, size_t n, char *data, unsign
 static inline bool depFile(uint64_t dirfp, const char *b, size_t blen)
 {
     uint64_t fp = hash64(b, blen, dirfp);
-    return fpset_has(depFiles, fp);
+    return depFilesHas(fp);
+}
+
+// Basename info: the length of a basename, with the high bit set
+// if the file is to be kept.
+#define BN_KEEP (1U << 31)
+// Preallocated per thread, like dirInfoBuf.
+static __thread unsigned bnInfoBuf[1024];
+
+// How many D_CHECK basenames are resolved in a batch.
+#define BN_BATCH 16
+
+// Load basename info for bn[n].  Some packages (e.g. kernel-headers
+// or texlive) have tens of thousands of files under D_CHECK dirs, and
+// checking them one by one would take a dependent cache miss per file.
+// Instead, the fingerprints of a batch of D_CHECK basenames are computed
+// and their buckets prefetched, and only then the batch is resolved.
+static void makeBnInfo(unsigned *bninfo, const char *bn, const char *end,
+		       const unsigned *di, size_t n,
+		       const struct dirInfoB *dinfo, size_t dnc)
+{
+    size_t bi[BN_BATCH];
+    uint64_t bfp[BN_BATCH];
+    size_t nb = 0;
+    argzLens(bn, end, n, bninfo, 1);
+    for (size_t i = 0; i < n; i++) {
+	size_t j = ntohl(di[i]);
+	assert(j < dnc);
+	const struct dirInfoB *d = &dinfo[j];
+	size_t blen = bninfo[i];
+	assert(blen < BN_KEEP);
+	switch (d->need) {
+	case D_CHECK: {
+	    uint64_t fp = hash64(bn, blen, d->fp);
+	    depFilesPrefetch(fp);
+	    bi[nb] = i, bfp[nb] = fp;
+	    if (++nb < BN_BATCH)
+		break;
+	    for (size_t k = 0; k < nb; k++)
+		if (depFilesHas(bfp[k]))
+		    bninfo[bi[k]] |= BN_KEEP;
+	    nb = 0;
+	    break;
+	}
+	case D_BIN:
+	    bninfo[i] |= BN_KEEP;
+	    break;
+	default:
+	    assert(d->need == D_SKIP);
+	}
+	bn += blen + 1;
+    }
+    for (size_t k = 0; k < nb; k++)
+	if (depFilesHas(bfp[k]))
+	    bninfo[bi[k]] |= BN_KEEP;
 }
 
 #include <sys/auxv.h>
 #include <unistd.h>
 
-// Called only once by one of the routines that add depFiles.
-static __attribute__((noinline)) void initDepFiles(void)
+// Called only once by one of the routines that add depFiles,
+// via pthread_once, since findDepFilesB can run in parallel.
+static pthread_once_t depFilesOnce = PTHREAD_ONCE_INIT;
+static void initDepFiles(void)
 {
-    depFiles = fpset_new(10);
-    assert(depFiles);
     // Since Linux 2.6.29, glibc 2.16.
     void *auxrnd = (void *) getauxval(AT_RANDOM);
     assert(auxrnd);
     memcpy(&fpseed, auxrnd, sizeof fpseed);
 }
 
+#include "qsort.h"
+
+// Called only once, before the first query.
+static pthread_once_t freezeOnce = PTHREAD_ONCE_INIT;
+static void freezeDepFiles(void)
+{
+    depFilesFrozen = true;
+    uint64_t *fp = depFilesBuf.fp;
+    size_t n = depFilesBuf.n;
+    if (n == 0)
+	return;
+    // Remove duplicates.
+    uint64_t tmp;
+#define fp_less(i, j) fp[i] < fp[j]
+#define fp_swap(i, j) tmp = fp[i], fp[i] = fp[j], fp[j] = tmp
+    QSORT(n, fp_less, fp_swap);
+    size_t k = 1;
+    for (size_t i = 1; i < n; i++)
+	if (fp[i] != fp[k-1])
+	    fp[k++] = fp[i];
+    n = k;
+    // At most 4 fingerprints per bucket, on average.
+    size_t nb = 1;
+    while (nb * BUCKET_FP / 2 < n)
+	nb *= 2;
+    depFiles = aligned_alloc(64, nb * sizeof *depFiles);
+    if (!depFiles)
+	die("cannot allocate %zu bytes", nb * sizeof *depFiles);
+    memset(depFiles, 0, nb * sizeof *depFiles);
+    depFilesMask = nb - 1;
+    for (size_t i = 0; i < n; i++) {
+	uint64_t x = fp[i] + !fp[i];
+	size_t b = x & depFilesMask;
+	while (1) {
+	    uint64_t *slot = depFiles[b];
+	    int j = 0;
+	    while (j < BUCKET_FP && slot[j])
+		j++;
+	    if (j < BUCKET_FP) {
+		slot[j] = x;
+		break;
+	    }
+	    b = (b + 1) & depFilesMask;
+	}
+    }
+    // The buffer is no longer needed.
+    free(depFilesBuf.fp);
+    depFilesBuf.fp = NULL;
+    depFilesBuf.n = depFilesBuf.alloc = 0;
+}
+
 // Called upon exit.
 static __attribute__((destructor)) void freeDepFiles(void)
 {
-    fpset_free(depFiles);
+    free(depFiles);
+    free(depFilesBuf.fp);
+    for (size_t i = 0; i < sizeof dirCache / sizeof *dirCache; i++)
+	free(dirCache[i]);
 }
 
 // The API starts here.
@@ -351,8 +615,7 @@ static __attribute__((destructor)) void freeDepFiles(void)
 // be tested against the set of depFiles and possibly preserved in the output.
 void findDepFilesH(Header h)
 {
-    if (!depFiles)
-	initDepFiles();
+    pthread_once(&depFilesOnce, initDepFiles);
     // Empty Requires are not permitted - someplace, they check
     // for the "rpmlib(PayloadIsLzma)" dependency as mandatory.
     bool hasReq = findDepFilesH1(h, RPMTAG_REQUIRENAME);
@@ -374,11 +637,9 @@ void findDepFilesH(Header h)
     // package names.  They should have no effect on filenames.
 }
 
-// A findDepFilesH counterpart which can process raw header blobs.
-void findDepFilesB(const void *blob, size_t blobSize)
+// Pass the filename dependencies of a raw header blob to cb.
+static void scanDepFilesB(const void *blob, size_t blobSize, depFileCb cb, void *arg)
 {
-    if (!depFiles)
-	initDepFiles();
     unsigned il = ntohl(*((unsigned *) blob + 0));
     unsigned dl = ntohl(*((unsigned *) blob + 1));
     assert(8 + 16 * il + dl == blobSize);
@@ -393,23 +654,82 @@ void findDepFilesB(const void *blob, size_t blobSize)
 	e++;
 	assert(e->tag == htonl(RPMTAG_PROVIDENAME));
     }
-    findDepFilesB1(e, data, dl);
+    findDepFilesB1(e, data, dl, cb, arg);
     // RequireName follows ProvideName and RequireFlags.
     e += 2;
     assert(e->tag == htonl(RPMTAG_REQUIRENAME));
-    findDepFilesB1(e, data, dl);
+    findDepFilesB1(e, data, dl, cb, arg);
     // ConflictName follows RequireName, RequireVersion, and ConflictFlags.
     // Conflicts are optional, though.
     e += 3;
     if (e->tag != htonl(RPMTAG_CONFLICTNAME))
 	assert(ntohl(e->tag) > RPMTAG_CONFLICTNAME);
     else
-	findDepFilesB1(e, data, dl);
+	findDepFilesB1(e, data, dl, cb, arg);
+}
+
+static void addDepFileCb(void *arg, const char *dep, size_t len)
+{
+    addDepFile(dep, len, arg);
+}
+
+// A findDepFilesH counterpart which can process raw header blobs.
+// The fingerprints go to the buffer of the current thread.
+void findDepFilesB(const void *blob, size_t blobSize)
+{
+    pthread_once(&depFilesOnce, initDepFiles);
+    scanDepFilesB(blob, blobSize, addDepFileCb, localFpbuf());
+}
+
+struct listArg {
+    depFileCb cb;
+    void *arg;
+};
+
+static void listDepFileCb(void *arg, const char *dep, size_t len)
+{
+    struct listArg *a = arg;
+    if (depFileDirLen(dep, len))
+	a->cb(a->arg, dep, len);
+}
+
+// Only the dependencies which would be added are listed.
+void listDepFilesB(const void *blob, size_t blobSize, depFileCb cb, void *arg)
+{
+    struct listArg a = { cb, arg };
+    scanDepFilesB(blob, blobSize, listDepFileCb, &a);
+}
+
+// Add a single filename dependency, e.g. from the depstate file.
+void putDepFile(const char *dep, size_t len)
+{
+    pthread_once(&depFilesOnce, initDepFiles);
+    addDepFile(dep, len, NULL);
+}
+
+// Merge the per-thread buffers into depFiles.
+void mergeDepFiles(void)
+{
+    pthread_mutex_lock(&fpbufMutex);
+    struct fpbuf *buf = fpbufList;
+    fpbufList = NULL;
+    pthread_mutex_unlock(&fpbufMutex);
+    while (buf) {
+	for (size_t i = 0; i < buf->n; i++)
+	    addFp(NULL, buf->fp[i]);
+	struct fpbuf *next = buf->next;
+	free(buf->fp);
+	free(buf);
+	buf = next;
+    }
+    // The buffer of the calling thread is gone, too.
+    fpbufLocal = NULL;
 }
 
 // Copy useful files from h1 to h2.
 void copyStrippedFileList(Header h1, Header h2)
 {
+    pthread_once(&freezeOnce, freezeDepFiles);
     // Load Dirnames first.
     struct rpmtd_s td_dn;
     int rc = headerGet(h1, RPMTAG_DIRNAMES, &td_dn, HEADERGET_MINMEM);
@@ -500,6 +820,7 @@ void copyStrippedFileList(Header h1, Header h2)
 // to the blobs created with librpm API.
 size_t stripFileList(void *blob, size_t blobSize)
 {
+    pthread_once(&freezeOnce, freezeDepFiles);
     unsigned il = ntohl(*((unsigned *) blob + 0));
     unsigned dl = ntohl(*((unsigned *) blob + 1));
     assert(8 + 16 * il + dl == blobSize);
@@ -514,10 +835,12 @@ size_t stripFileList(void *blob, size_t blobSize)
     // The data pointer, used as a source for copying, always stays the same.
     char *data = (char *) eend;
     // We expect 4 last entries to be APT tags (starting with CRPMTAG_FILENAME),
-    // preceded by (Basenames,Dirnames,Dirindexes), and we probe one more entry
-    // before Basenames.
+    // or 5 with CRPMTAG_SHA256, preceded by (Basenames,Dirnames,Dirindexes),
+    // and we probe one more entry before Basenames.
     assert(il > 7);
     struct ent *e = eend - 4;
+    if (e->tag != htonl(CRPMTAG_FILENAME))
+	assert(il > 8), e--;
     assert(e->tag == htonl(CRPMTAG_FILENAME));
     // Position e[0] = Dirindexes, e[1] = Basenames, e[2] = Dirnames.
     enum { E_DI, E_BN, E_DN };
@@ -564,7 +887,7 @@ size_t stripFileList(void *blob, size_t blobSize)
 	off = ntohl(e[E_BN].off); assert(off < dl);
 	char *bn0 = data + off, *bn1 = bn0, *bn2 = bn1;
 	// Dirnames may need reordering, and rewriting them inplace is problematic.
-	static char dn0buf[256];
+	static __thread char dn0buf[256];
 	char *dn0 = NULL, *dn2 = NULL;
 	// The last matching dirindex between the input and the output.
 	ssize_t maxdi = -1;
@@ -583,22 +906,20 @@ size_t stripFileList(void *blob, size_t blobSize)
 	    // At least on Haswell, however, the nested loop would ruin the
 	    // performance of the outer loop.
 	}
+	// Decide which files to keep, all in a batch, before anything
+	// is moved, so that the lookups can be prefetched.
+	unsigned *bninfo = bnInfoBuf;
+	if (bnc1 > sizeof bnInfoBuf / sizeof *bnInfoBuf)
+	    bninfo = xmalloc(bnc1 * sizeof *bninfo);
+	makeBnInfo(bninfo, bn0, data + dl, di1, bnc1, dinfo, dnc1);
 	// Run the copy loop.
 	for (size_t i = 0; i < bnc1; i++) {
 	    size_t di = ntohl(di1[i]);
-	    assert(di < dnc1);
 	    struct dirInfoB *d = &dinfo[di];
-	    assert(bn1 < data + dl);
-	    size_t blen = strlen(bn1);
-	    switch (d->need) {
-	    case D_CHECK:
-		if (depFile(d->fp, bn1, blen))
-		    break;
-	    case D_SKIP:
+	    size_t blen = bninfo[i] & ~BN_KEEP;
+	    if (!(bninfo[i] & BN_KEEP)) {
 		bn1 += blen + 1;
 		continue;
-	    default:
-		assert(d->need == D_BIN);
 	    }
 	    // Trying to take advantage of the fact that filenames under /bin/
 	    // and /usr/bin/ are often the very first filenames in a package.
@@ -638,6 +959,8 @@ size_t stripFileList(void *blob, size_t blobSize)
 	    }
 	    bnc2++;
 	}
+	if (bninfo != bnInfoBuf)
+	    free(bninfo);
 	// No useful files found?
 	if (bnc2 == 0) {
 	    // Pretend as if makeDirInfoB returned NULL.
@@ -785,8 +1108,7 @@ size_t stripFileList(void *blob, size_t blobSize)
 // Read filenames from --useful-files=FILE.
 void readDepFiles(const char *fname, unsigned char delim)
 {
-    if (!depFiles)
-	initDepFiles();
+    pthread_once(&depFilesOnce, initDepFiles);
     FILE *fp = fopen(fname, "r");
     if (!fp)
 	die("%s: %m", fname);
@@ -806,7 +1128,7 @@ void readDepFiles(const char *fname, unsigned char delim)
 	    continue;
 	if (*line != '/')
 	    die("%s: bad input", fname);
-	addDepFile(line, len);
+	addDepFile(line, len, NULL);
     }
     // Distinguish between EOF and error.
     assert(errno == 0);
@@ -814,4 +1136,89 @@ void readDepFiles(const char *fname, unsigned char delim)
     fclose(fp);
 }
 
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The fingerprint file, as written by writeDepFilesFp: the magic, the seed,
+// the number of fingerprints, and the fingerprints, sorted and unique.
+// All integers are 64-bit little-endian.
+static const char fpMagic[8] = "depfp\0\0\1";
+
+// Write the fingerprints added so far, along with the seed (atomically,
+// via rename).
+void writeDepFilesFp(const char *fname)
+{
+    pthread_once(&depFilesOnce, initDepFiles);
+    assert(!depFilesFrozen);
+    mergeDepFiles();
+    uint64_t *fp = depFilesBuf.fp;
+    size_t n = depFilesBuf.n;
+    uint64_t tmp;
+    QSORT(n, fp_less, fp_swap);
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++)
+	if (k == 0 || fp[i] != fp[k-1])
+	    fp[k++] = fp[i];
+    depFilesBuf.n = n = k;
+    // Write to the temporary file, so that a concurrent reader
+    // never sees a partial file.
+    size_t len = strlen(fname);
+    char tmpname[len + sizeof ".tmp"];
+    memcpy(tmpname, fname, len);
+    memcpy(tmpname + len, ".tmp", sizeof ".tmp");
+    FILE *f = fopen(tmpname, "w");
+    if (!f)
+	die("%s: %m", tmpname);
+    uint64_t x[2] = { htole64(fpseed), htole64(n) };
+    fwrite(fpMagic, 1, sizeof fpMagic, f);
+    fwrite(x, sizeof x, 1, f);
+    for (size_t i = 0; i < n; i++) {
+	uint64_t y = htole64(fp[i]);
+	fwrite(&y, sizeof y, 1, f);
+    }
+    if (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) < 0)
+	die("%s: %m", tmpname);
+    if (fclose(f) != 0)
+	die("%s: %m", tmpname);
+    if (rename(tmpname, fname) < 0)
+	die("%s: %m", fname);
+}
+
+// Load a file written by writeDepFilesFp.  The fingerprints are only valid
+// with the seed they were made with, so the seed is adopted.
+void loadDepFilesFp(const char *fname)
+{
+    pthread_once(&depFilesOnce, initDepFiles);
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+	die("%s: %m", fname);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+	die("%s: %m", fname);
+    size_t size = st.st_size;
+    if (size < 24)
+	die("%s: bad fingerprint file", fname);
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+	die("%s: %m", fname);
+    close(fd);
+    uint64_t x[2];
+    memcpy(x, map + 8, sizeof x);
+    uint64_t seed = le64toh(x[0]), n = le64toh(x[1]);
+    if (memcmp(map, fpMagic, 8) || n != (size - 24) / 8 || size % 8)
+	die("%s: bad fingerprint file", fname);
+    // Nothing must have been hashed with the random seed yet.
+    bool fresh = depFilesBuf.n == 0 && fpbufList == NULL && !depFilesFrozen;
+    if (fresh)
+	fpseed = seed;
+    else if (seed != fpseed)
+	die("%s: fingerprint seed mismatch", fname);
+    const uint64_t *fp = (const void *) (map + 24);
+    for (size_t i = 0; i < n; i++)
+	addFp(NULL, le64toh(fp[i]));
+    munmap((void *) map, size);
+}
+
 // ex:set ts=8 sts=4 sw=4 noet:
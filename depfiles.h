@@ -23,12 +23,34 @@
 // Read filenames from --useful-files=FILE.
 void readDepFiles(const char *fname, unsigned char delim);
 
+// Instead of parsing the same lists on each run, they can be compiled
+// into a binary file of fingerprints, which carries its own seed.
+// Since the seed is adopted on loading, the file must be loaded before
+// any other depFiles are added, or else all the files must share the seed.
+void writeDepFilesFp(const char *fname);
+void loadDepFilesFp(const char *fname);
+
 // Retrieve filename dependencies from tags like %{REQUIRENAME}.
 void findDepFilesH(Header h);
+
+// The blob version can be called by a few threads concurrently.  Each thread
+// collects the dependencies on its own; once all the threads are done with
+// findDepFilesB, the results must be merged with mergeDepFiles.
 void findDepFilesB(const void *blob, size_t blobSize);
+void mergeDepFiles(void);
+
+// Instead of adding the dependencies to depFiles, pass them to the callback
+// (dep is not null-terminated).  This is how depstate learns about the
+// dependencies of new packages; it then adds them with putDepFile.
+typedef void (*depFileCb)(void *arg, const char *dep, size_t len);
+void listDepFilesB(const void *blob, size_t blobSize, depFileCb cb, void *arg);
+void putDepFile(const char *dep, size_t len);
 
 // Copy useful files from h1 to h2.
 void copyStrippedFileList(Header h1, Header h2);
 
-// Strip file list inplace, returns the new size.
+// Strip file list inplace, returns the new size.  Can be called by a few
+// threads concurrently.  The first call (or the first copyStrippedFileList
+// call) freezes depFiles into a read-only table; no more depFiles can be
+// added after that.
 size_t stripFileList(void *blob, size_t blobSize);
@@ -0,0 +1,418 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <string.h>
+#include <assert.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <t1ha.h>
+#include "qsort.h"
+#include "errexit.h"
+#include "depfiles.h"
+#include "depstate.h"
+
+// The file starts with the magic, followed by the dependencies and then
+// by the packages.  All integers are 32-bit little-endian.
+//	magic[8]
+//	ndep, ndep * { ref, len, name[len], '\0' }
+//	npkg, npkg * { len, rpm[len], '\0', size[2], mtime[2], n, n * { dep index } }
+// Packages are sorted by filename.  The size and mtime are 64-bit, low word
+// first.
+static const char magic[8] = "depst\0\0\1";
+
+struct dep {
+    const char *name;
+    unsigned len;
+    unsigned ref;
+    // The last package which referenced the dependency, to count
+    // each dependency only once per package.
+    size_t lastPkg;
+};
+
+struct pkg {
+    const char *rpm;
+    // The package is only kept if the file is still the same.
+    uint64_t size;
+    int64_t mtime;
+    unsigned *ids;
+    unsigned n;
+    bool keep;
+};
+
+struct depstate {
+    // The contents of the file.  The names of loaded deps and pkgs
+    // point into it, while the names of new ones are malloc'd.
+    char *file;
+    size_t nold, noldDep;
+    struct dep *dep;
+    size_t ndep, depAlloc;
+    // The index of deps by name, dep index + 1, 0 being empty.
+    unsigned *htab;
+    size_t hmask;
+    struct pkg *pkg;
+    size_t npkg, pkgAlloc;
+    // The loaded ids, a single chunk.
+    unsigned *oldIds;
+    // The position of the merge-like walk in depstate_keep.
+    size_t pos;
+    const char *lastRpm;
+    char fname[];
+};
+
+static inline uint64_t hashDep(const char *name, size_t len)
+{
+    return t1ha0(name, len, 0);
+}
+
+static void rehash(struct depstate *s)
+{
+    size_t size = 1024;
+    while (size < 2 * s->ndep)
+	size *= 2;
+    free(s->htab);
+    s->htab = xmalloc(size * sizeof *s->htab);
+    memset(s->htab, 0, size * sizeof *s->htab);
+    s->hmask = size - 1;
+    for (size_t i = 0; i < s->ndep; i++) {
+	size_t k = hashDep(s->dep[i].name, s->dep[i].len) & s->hmask;
+	while (s->htab[k])
+	    k = (k + 1) & s->hmask;
+	s->htab[k] = i + 1;
+    }
+}
+
+// Find or create a dependency, returns its index.
+static unsigned depIndex(struct depstate *s, const char *name, size_t len)
+{
+    size_t k = hashDep(name, len) & s->hmask;
+    while (s->htab[k]) {
+	struct dep *d = &s->dep[s->htab[k]-1];
+	if (d->len == len && memcmp(d->name, name, len) == 0)
+	    return s->htab[k] - 1;
+	k = (k + 1) & s->hmask;
+    }
+    if (s->ndep == s->depAlloc) {
+	s->depAlloc = s->depAlloc ? 2 * s->depAlloc : 1024;
+	s->dep = realloc(s->dep, s->depAlloc * sizeof *s->dep);
+	if (!s->dep)
+	    die("cannot allocate %zu bytes", s->depAlloc * sizeof *s->dep);
+    }
+    char *copy = xmalloc(len + 1);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    s->dep[s->ndep] = (struct dep) { copy, len, 0, (size_t) -1 };
+    s->htab[k] = ++s->ndep;
+    // Keep the load factor below 1/2.
+    if (2 * s->ndep > s->hmask)
+	rehash(s);
+    return s->ndep - 1;
+}
+
+static struct pkg *pushPkg(struct depstate *s)
+{
+    if (s->npkg == s->pkgAlloc) {
+	s->pkgAlloc = s->pkgAlloc ? 2 * s->pkgAlloc : 1024;
+	s->pkg = realloc(s->pkg, s->pkgAlloc * sizeof *s->pkg);
+	if (!s->pkg)
+	    die("cannot allocate %zu bytes", s->pkgAlloc * sizeof *s->pkg);
+    }
+    return &s->pkg[s->npkg++];
+}
+
+// Read the whole file, returns NULL if the file does not exist.
+static char *slurp(const char *fname, size_t *sizep)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+	if (errno == ENOENT)
+	    return NULL;
+	die("%s: %m", fname);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+	die("%s: %m", fname);
+    size_t size = st.st_size;
+    char *buf = xmalloc(size + 1);
+    size_t pos = 0;
+    while (pos < size) {
+	ssize_t ret = read(fd, buf + pos, size - pos);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    die("%s: %m", fname);
+	}
+	if (ret == 0)
+	    die("%s: %s", fname, "unexpected EOF");
+	pos += ret;
+    }
+    close(fd);
+    *sizep = size;
+    return buf;
+}
+
+// Parsing the file, with bounds checking.
+struct cursor { const char *p, *end; const char *fname; };
+
+static unsigned get32(struct cursor *c)
+{
+    if (c->end - c->p < 4)
+	die("%s: bad depstate file", c->fname);
+    unsigned x;
+    memcpy(&x, c->p, 4);
+    c->p += 4;
+    return le32toh(x);
+}
+
+static uint64_t get64(struct cursor *c)
+{
+    uint64_t lo = get32(c);
+    uint64_t hi = get32(c);
+    return hi << 32 | lo;
+}
+
+static const char *getStr(struct cursor *c, unsigned *lenp)
+{
+    unsigned len = get32(c);
+    if ((size_t) (c->end - c->p) <= len || c->p[len] != '\0')
+	die("%s: bad depstate file", c->fname);
+    const char *str = c->p;
+    c->p += len + 1;
+    *lenp = len;
+    return str;
+}
+
+struct depstate *depstate_open(const char *fname)
+{
+    size_t len = strlen(fname);
+    struct depstate *s = xmalloc(sizeof *s + len + 1);
+    memset(s, 0, sizeof *s);
+    memcpy(s->fname, fname, len + 1);
+    size_t size;
+    s->file = slurp(fname, &size);
+    if (!s->file) {
+	rehash(s);
+	return s;
+    }
+    struct cursor c = { s->file, s->file + size, s->fname };
+    if (size < sizeof magic || memcmp(s->file, magic, sizeof magic))
+	die("%s: bad depstate file", fname);
+    c.p += sizeof magic;
+    // Load the deps.
+    size_t ndep = get32(&c);
+    s->dep = xmalloc((ndep ? ndep : 1) * sizeof *s->dep);
+    s->depAlloc = ndep;
+    unsigned *refs = xmalloc((ndep ? ndep : 1) * sizeof *refs);
+    for (size_t i = 0; i < ndep; i++) {
+	refs[i] = get32(&c);
+	unsigned dlen;
+	const char *name = getStr(&c, &dlen);
+	s->dep[i] = (struct dep) { name, dlen, 0, (size_t) -1 };
+    }
+    s->ndep = s->noldDep = ndep;
+    rehash(s);
+    // Load the pkgs; the ids are verified, and the reference counts
+    // are recomputed.
+    size_t npkg = get32(&c);
+    s->pkg = xmalloc((npkg ? npkg : 1) * sizeof *s->pkg);
+    s->pkgAlloc = npkg;
+    size_t nids = (c.end - c.p) / 4;
+    s->oldIds = xmalloc((nids ? nids : 1) * sizeof *s->oldIds);
+    unsigned *ids = s->oldIds;
+    for (size_t i = 0; i < npkg; i++) {
+	struct pkg *p = pushPkg(s);
+	unsigned rlen;
+	p->rpm = getStr(&c, &rlen);
+	if (i && strcmp(p[-1].rpm, p->rpm) >= 0)
+	    die("%s: bad depstate file", fname);
+	p->size = get64(&c);
+	p->mtime = get64(&c);
+	p->n = get32(&c);
+	if (p->n > (size_t) (c.end - c.p) / 4)
+	    die("%s: bad depstate file", fname);
+	p->ids = ids;
+	p->keep = false;
+	for (unsigned j = 0; j < p->n; j++) {
+	    unsigned id = get32(&c);
+	    if (id >= ndep)
+		die("%s: bad depstate file", fname);
+	    p->ids[j] = id;
+	    s->dep[id].ref++;
+	}
+	ids += p->n;
+    }
+    if (c.p != c.end)
+	die("%s: bad depstate file", fname);
+    for (size_t i = 0; i < ndep; i++)
+	if (s->dep[i].ref != refs[i])
+	    die("%s: bad depstate file", fname);
+    free(refs);
+    s->nold = npkg;
+    return s;
+}
+
+bool depstate_keep(struct depstate *s, const char *rpm, const struct stat *st)
+{
+    assert(!s->lastRpm || strcmp(s->lastRpm, rpm) < 0);
+    s->lastRpm = rpm;
+    while (s->pos < s->nold) {
+	struct pkg *p = &s->pkg[s->pos];
+	int cmp = strcmp(p->rpm, rpm);
+	if (cmp > 0)
+	    break;
+	s->pos++;
+	if (cmp == 0)
+	    return p->keep = p->size == (uint64_t) st->st_size &&
+			     p->mtime == st->st_mtime;
+    }
+    return false;
+}
+
+void depstate_add(struct depstate *s, const char *rpm, const struct stat *st,
+		  const char *argz, size_t argzLen)
+{
+    size_t ipkg = s->npkg;
+    // Count the deps.
+    unsigned n = 0;
+    for (const char *p = argz; p < argz + argzLen; p += strlen(p) + 1)
+	n++;
+    unsigned *ids = xmalloc((n ? n : 1) * sizeof *ids);
+    n = 0;
+    for (const char *p = argz; p < argz + argzLen; ) {
+	size_t len = strlen(p);
+	unsigned id = depIndex(s, p, len);
+	struct dep *d = &s->dep[id];
+	if (d->lastPkg != ipkg) {
+	    d->lastPkg = ipkg;
+	    d->ref++;
+	    ids[n++] = id;
+	}
+	p += len + 1;
+    }
+    size_t rlen = strlen(rpm);
+    char *copy = xmalloc(rlen + 1);
+    memcpy(copy, rpm, rlen + 1);
+    struct pkg *p = pushPkg(s);
+    *p = (struct pkg) { copy, st->st_size, st->st_mtime, ids, n, true };
+}
+
+void depstate_commit(struct depstate *s)
+{
+    for (size_t i = 0; i < s->nold; i++) {
+	struct pkg *p = &s->pkg[i];
+	if (p->keep)
+	    continue;
+	for (unsigned j = 0; j < p->n; j++) {
+	    assert(s->dep[p->ids[j]].ref > 0);
+	    s->dep[p->ids[j]].ref--;
+	}
+    }
+    for (size_t i = 0; i < s->ndep; i++)
+	if (s->dep[i].ref)
+	    putDepFile(s->dep[i].name, s->dep[i].len);
+}
+
+static void put32(FILE *fp, unsigned x)
+{
+    x = htole32(x);
+    fwrite(&x, 4, 1, fp);
+}
+
+static void put64(FILE *fp, uint64_t x)
+{
+    put32(fp, x);
+    put32(fp, x >> 32);
+}
+
+static void putStr(FILE *fp, const char *str, size_t len)
+{
+    put32(fp, len);
+    fwrite(str, 1, len + 1, fp);
+}
+
+void depstate_close(struct depstate *s)
+{
+    // The deps which are still referenced get the new indexes.
+    unsigned *newId = xmalloc((s->ndep ? s->ndep : 1) * sizeof *newId);
+    unsigned ndep = 0;
+    for (size_t i = 0; i < s->ndep; i++)
+	newId[i] = s->dep[i].ref ? ndep++ : (unsigned) -1;
+    // The packages which are still there, sorted by filename.
+    size_t *order = xmalloc((s->npkg ? s->npkg : 1) * sizeof *order);
+    size_t npkg = 0;
+    for (size_t i = 0; i < s->npkg; i++)
+	if (s->pkg[i].keep)
+	    order[npkg++] = i;
+    size_t tmp;
+#define order_less(i, j) strcmp(s->pkg[order[i]].rpm, s->pkg[order[j]].rpm) < 0
+#define order_swap(i, j) tmp = order[i], order[i] = order[j], order[j] = tmp
+    QSORT(npkg, order_less, order_swap);
+    // Write to the temporary file.
+    size_t len = strlen(s->fname);
+    char tmpname[len + sizeof ".tmp"];
+    memcpy(tmpname, s->fname, len);
+    memcpy(tmpname + len, ".tmp", sizeof ".tmp");
+    FILE *fp = fopen(tmpname, "w");
+    if (!fp)
+	die("%s: %m", tmpname);
+    fwrite(magic, 1, sizeof magic, fp);
+    put32(fp, ndep);
+    for (size_t i = 0; i < s->ndep; i++) {
+	struct dep *d = &s->dep[i];
+	if (!d->ref)
+	    continue;
+	put32(fp, d->ref);
+	putStr(fp, d->name, d->len);
+    }
+    put32(fp, npkg);
+    for (size_t k = 0; k < npkg; k++) {
+	struct pkg *p = &s->pkg[order[k]];
+	putStr(fp, p->rpm, strlen(p->rpm));
+	put64(fp, p->size);
+	put64(fp, p->mtime);
+	put32(fp, p->n);
+	for (unsigned j = 0; j < p->n; j++)
+	    put32(fp, newId[p->ids[j]]);
+    }
+    if (fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) < 0)
+	die("%s: %m", tmpname);
+    if (fclose(fp) != 0)
+	die("%s: %m", tmpname);
+    if (rename(tmpname, s->fname) < 0)
+	die("%s: %m", s->fname);
+    // Free the handle.
+    for (size_t i = s->noldDep; i < s->ndep; i++)
+	free((char *) s->dep[i].name);
+    for (size_t i = s->nold; i < s->npkg; i++) {
+	free((char *) s->pkg[i].rpm);
+	free(s->pkg[i].ids);
+    }
+    free(newId);
+    free(order);
+    free(s->dep);
+    free(s->htab);
+    free(s->pkg);
+    free(s->oldIds);
+    free(s->file);
+    free(s);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,55 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// With --depfiles-state=FILE, genpkglist keeps the filename dependencies
+// of each package in a file, so that on the next run, only the packages
+// which were added need to be scanned.  Fingerprints depend on the random
+// seed, so the dependencies are stored as strings.  Each dependency has
+// a reference count, i.e. the number of packages which require, provide,
+// or conflict with it.  As with prevout, packages are identified by their
+// filenames, and the file must only be used with the same RPMS.comp.
+// Along with the filename, the size and mtime of each package are stored;
+// if a file has changed in place, it is scanned again.
+
+// Load the state.  If the file does not exist, the state is empty.
+// Dies on error.
+struct depstate *depstate_open(const char *fname);
+
+// Check if the package is known and has the same size and mtime, in which
+// case its dependencies are kept.  Must be called in ascending strcmp order
+// of rpm filenames.
+bool depstate_keep(struct depstate *s, const char *rpm, const struct stat *st);
+
+// Record a new package, with its dependencies given as an argz vector
+// of argzLen bytes.
+void depstate_add(struct depstate *s, const char *rpm, const struct stat *st,
+		  const char *argz, size_t argzLen);
+
+// Drop the packages which were neither kept nor added, decreasing
+// the reference counts, and add the remaining dependencies to depFiles.
+void depstate_commit(struct depstate *s);
+
+// Write the state back to the file (atomically, via rename), and free
+// the handle.  Dies on error.
+void depstate_close(struct depstate *s);
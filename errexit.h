@@ -39,4 +39,16 @@ static inline void *xmalloc_(size_t n,
 
 #define xmalloc(n) xmalloc_(n, __func__, __FILE__, __LINE__)
 
+static inline void *xrealloc_(void *buf, size_t n,
+	const char *func, const char *file, int line)
+{
+    buf = realloc(buf, n);
+    if (buf == NULL)
+	die("cannot allocate %zu bytes in %s() at %s line %d",
+	    n, func, file, line);
+    return buf;
+}
+
+#define xrealloc(buf, n) xrealloc_(buf, n, __func__, __FILE__, __LINE__)
+
 // ex:set ts=8 sts=4 sw=4 noet:
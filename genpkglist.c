@@ -18,73 +18,567 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <string.h>
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include "qsort.h"
+
+// Binary rpm filenames are stored in the string tab.
+static char strtab[128<<20];
+static size_t strtabPos = 1;
+
+// Binary rpms which will be processed.
+static char *rpms[1<<20];
+static size_t nrpm;
+
+// Load rpms[] from RPMS.comp dirfd.
+static void loadDir(int dirfd)
+{
+    DIR *dirp = fdopendir(dirfd);
+    assert(dirp);
+    while (1) {
+	errno = 0;
+	struct dirent *d = readdir(dirp);
+	if (!d)
+	    break;
+	if (*d->d_name == '.')
+	    continue;
+	size_t len = strlen(d->d_name);
+	if (len <= 4 || memcmp(d->d_name + len - 4, ".rpm", 4))
+	    continue;
+	if (len > 8 && memcmp(d->d_name + len - 8, ".src.rpm", 8) == 0)
+	    continue;
+	assert(strtabPos + len + 1 < sizeof strtab);
+	memcpy(strtab + strtabPos, d->d_name, len + 1);
+	rpms[nrpm++] = strtab + strtabPos;
+	strtabPos += len + 1;
+    }
+    assert(errno == 0);
+    closedir(dirp);
+    char *tmp;
+#define rpms_less(i, j) strcmp(rpms[i], rpms[j]) < 0
+#define rpms_swap(i, j) tmp = rpms[i], rpms[i] = rpms[j], rpms[j] = tmp
+    QSORT(nrpm, rpms_less, rpms_swap);
+}
+
+#include "genutil.h"
+#include "crpmtag.h"
+#include "errexit.h"
+#include "md5cache.h"
+#include "projblob.h"
 #include "depfiles.h"
 
+// Note that findDepFilesB and stripFileList rely on the resulting layout
+// of the entries, e.g. ProvideName must end up at [13] or [14].
+static const int tags[] = {
+    RPMTAG_NAME,
+    RPMTAG_EPOCH,
+    RPMTAG_VERSION,
+    RPMTAG_RELEASE,
+    RPMTAG_GROUP,
+    RPMTAG_ARCH,
+    RPMTAG_PACKAGER,
+    RPMTAG_SOURCERPM,
+    RPMTAG_SIZE,
+    RPMTAG_VENDOR,
+    RPMTAG_OS,
+
+    RPMTAG_DESCRIPTION,
+    RPMTAG_SUMMARY,
+    /*RPMTAG_HEADERI18NTABLE*/ HEADER_I18NTABLE,
+
+    RPMTAG_REQUIREFLAGS,
+    RPMTAG_REQUIRENAME,
+    RPMTAG_REQUIREVERSION,
+
+    RPMTAG_CONFLICTFLAGS,
+    RPMTAG_CONFLICTNAME,
+    RPMTAG_CONFLICTVERSION,
+
+    RPMTAG_PROVIDENAME,
+    RPMTAG_PROVIDEFLAGS,
+    RPMTAG_PROVIDEVERSION,
+
+    RPMTAG_OBSOLETENAME,
+    RPMTAG_OBSOLETEFLAGS,
+    RPMTAG_OBSOLETEVERSION,
+
+    RPMTAG_DIRINDEXES,
+    RPMTAG_BASENAMES,
+    RPMTAG_DIRNAMES,
+};
+
+// With --sha256, CRPMTAG_SHA256 is added to the credentials.
+static int sha256;
+
+static void *makeBlob(const char *rpmdir, const char *rpm, int fd, size_t *sizep)
+{
+    // Load the raw header.
+    size_t blobSize;
+    void *blob = readHeaderBlob(rpm, fd, &blobSize);
+    if (!blob)
+	die("%s: cannot read package header", rpm);
+    // Prepare credentials.
+    struct stat st;
+    int rc = fstat(fd, &st);
+    assert(rc == 0);
+    char md5[33], sha[65];
+    md5cache(rpm, &st, fd, md5, sha256 ? sha : NULL);
+    struct blobcred cred = { rpmdir, rpm, st.st_size, md5, sha256 ? sha : NULL };
+    // Make the output blob.
+    void *blob2 = projectBlob(blob, blobSize, tags, sizeof tags / sizeof *tags,
+			      &cred, sizep);
+    if (!blob2)
+	die("%s: bad package header", rpm);
+    free(blob);
+    return blob2;
+}
+
+// The headers, indexed the same way as rpms[].  The headers picked up from
+// the previous output point into the PREVOUT_MMAP mapping and are not owned.
+static struct blob {
+    void *blob;
+    size_t blobSize;
+    bool own;
+} *blobs;
+
+// The passes below run on behalf of worker threads, with jobs_run.
+// Each job updates only its own blobs[i] entry.
+struct makeBlobArg {
+    const char *rpmdir;
+    // Indexes into rpms[] which were not picked up from the previous output.
+    size_t *todo, ntodo;
+};
+
+static void *makeBlobJob(void *arg, size_t k, size_t *sizep)
+{
+    struct makeBlobArg *a = arg;
+    // Prefetch the next few headers.
+    if (k + NPREFETCH < a->ntodo)
+	prefetch(rpms, a->todo[k+NPREFETCH]);
+    size_t i = a->todo[k];
+    int fd = takeFd(rpms, i);
+    blobs[i].blob = makeBlob(a->rpmdir, rpms[i], fd, &blobs[i].blobSize);
+    blobs[i].own = true;
+    close(fd);
+    return NULL;
+}
+
+// Pass 1: collect filename dependencies.
+static void *findDepFilesJob(void *arg, size_t i, size_t *sizep)
+{
+    findDepFilesB(blobs[i].blob, blobs[i].blobSize);
+    return NULL;
+}
+
+// With --depfiles-state, pass 1 only lists the dependencies of new packages.
+struct depList {
+    char *argz;
+    size_t len, alloc;
+};
+
+static void depListAdd(void *arg, const char *dep, size_t len)
+{
+    struct depList *l = arg;
+    if (l->len + len + 1 > l->alloc) {
+	l->alloc = 2 * (l->len + len + 1);
+	l->argz = realloc(l->argz, l->alloc);
+	if (!l->argz)
+	    die("cannot allocate %zu bytes", l->alloc);
+    }
+    memcpy(l->argz + l->len, dep, len);
+    l->argz[l->len + len] = '\0';
+    l->len += len + 1;
+}
+
+struct listDepsArg {
+    // Indexes into rpms[] which are not in the state.
+    size_t *scan;
+    struct depList *lists;
+};
+
+static void *listDepsJob(void *arg, size_t k, size_t *sizep)
+{
+    struct listDepsArg *a = arg;
+    size_t i = a->scan[k];
+    listDepFilesB(blobs[i].blob, blobs[i].blobSize, depListAdd, &a->lists[k]);
+    return NULL;
+}
+
+// Pass 2: strip the file lists, which only reads depFiles.
+static void *stripFileListJob(void *arg, size_t i, size_t *sizep)
+{
+    blobs[i].blobSize = stripFileList(blobs[i].blob, blobs[i].blobSize);
+    return NULL;
+}
+
+#include <arpa/inet.h>
+
+// Raw header entry, network byte order.
+struct ent { int tag, type, off, cnt; };
+
+// Find %{SOURCERPM} in a blob, to group the output by source package.
+static const char *sourceRpm(const void *blob)
+{
+    unsigned il = ntohl(*((unsigned *) blob + 0));
+    unsigned dl = ntohl(*((unsigned *) blob + 1));
+    const struct ent *ee = (const void *) ((const char *) blob + 8);
+    const char *data = (const char *) (ee + il);
+    // The entries are sorted by tag, and SOURCERPM comes early on.
+    for (const struct ent *e = ee; e < ee + il; e++) {
+	if (e->tag != htonl(RPMTAG_SOURCERPM))
+	    continue;
+	assert(e->type == htonl(RPM_STRING_TYPE));
+	unsigned off = ntohl(e->off);
+	assert(off < dl);
+	return data + off;
+    }
+    return "";
+}
+
 #include <getopt.h>
+#include <limits.h>
+#include <unistd.h>
 #include <fcntl.h>
-#include "errexit.h"
+#include <sys/stat.h>
+#include "jobs.h"
+#include "outpipe.h"
+#include "depstate.h"
 
 enum {
     OPT_BLOAT = 256,
+    OPT_PREV_OUT,
     OPT_USEFUL_FILES_FROM,
     OPT_USEFUL_FILES0_FROM,
+    OPT_DEPFILES_STATE,
+    OPT_USEFUL_FILES_FP,
+    OPT_COMPILE_USEFUL_FILES,
+    OPT_SEED_CACHE,
+    OPT_EXPORT_CACHE,
+    OPT_IMPORT_CACHE,
+    OPT_SCRUB,
 };
 
 static int bloat;
+static int compactCache;
 
 static const struct option longopts[] = {
     { "help", no_argument, NULL, 'h' },
     { "bloat", no_argument, &bloat, 1 },
+    { "use-prev-output", required_argument, NULL, OPT_PREV_OUT },
     { "useful-files", required_argument, NULL, OPT_USEFUL_FILES_FROM },
     { "useful-files-from", required_argument, NULL, OPT_USEFUL_FILES_FROM },
     { "useful-files0-from", required_argument, NULL, OPT_USEFUL_FILES0_FROM },
+    { "useful-files-fp", required_argument, NULL, OPT_USEFUL_FILES_FP },
+    { "compile-useful-files", required_argument, NULL, OPT_COMPILE_USEFUL_FILES },
+    { "depfiles-state", required_argument, NULL, OPT_DEPFILES_STATE },
+    { "sha256", no_argument, &sha256, 1 },
+    { "direct-io", no_argument, &md5cache_odirect, 1 },
+    { "inode-cache", no_argument, &md5cache_inode, 1 },
+    { "compact-cache", no_argument, &compactCache, 1 },
+    { "seed-cache", required_argument, NULL, OPT_SEED_CACHE },
+    { "export-cache", required_argument, NULL, OPT_EXPORT_CACHE },
+    { "import-cache", required_argument, NULL, OPT_IMPORT_CACHE },
+    { "scrub", required_argument, NULL, OPT_SCRUB },
+    { "jobs", required_argument, NULL, 'j' },
     { NULL },
 };
 
 int main(int argc, char **argv)
 {
-#define USEFUL_FILES_MAX 8
+    // Each option takes at least one argv slot.
     size_t usefulFilesCount = 0;
-    const char *usefulFilesFrom[USEFUL_FILES_MAX];
-    char usefulFilesDelim[USEFUL_FILES_MAX];
+    const char *usefulFilesFrom[argc];
+    char usefulFilesDelim[argc];
+    size_t usefulFilesFpCount = 0;
+    const char *usefulFilesFp[argc];
+    const char *compileTo = NULL;
+    const char *prevout_from = NULL;
+    const char *seedFrom = NULL;
+    const char *exportTo = NULL;
+    const char *importFrom = NULL;
+    double scrubRate = 0;
+    const char *depstateFile = NULL;
+    int njobs = 1;
     int c;
-    while ((c = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "hj:", longopts, NULL)) != -1) {
 	switch (c) {
 	case 0:
 	    break;
+	case OPT_PREV_OUT:
+	    prevout_from = optarg;
+	    break;
+	case OPT_SEED_CACHE:
+	    seedFrom = optarg;
+	    break;
+	case OPT_EXPORT_CACHE:
+	    exportTo = optarg;
+	    break;
+	case OPT_IMPORT_CACHE:
+	    importFrom = optarg;
+	    break;
+	case OPT_SCRUB: {
+	    // Megabytes per second.
+	    char *end;
+	    scrubRate = strtod(optarg, &end);
+	    if (end == optarg || *end || !(scrubRate > 0))
+		die("bad --scrub value: %s", optarg);
+	    break;
+	}
+	case OPT_DEPFILES_STATE:
+	    depstateFile = optarg;
+	    break;
 	case OPT_USEFUL_FILES_FROM:
-	    if (usefulFilesCount < USEFUL_FILES_MAX) {
-		usefulFilesFrom[usefulFilesCount] = optarg,
-		usefulFilesDelim[usefulFilesCount] = '\n';
-	    }
+	    usefulFilesFrom[usefulFilesCount] = optarg,
+	    usefulFilesDelim[usefulFilesCount] = '\n';
 	    usefulFilesCount++;
 	    break;
 	case OPT_USEFUL_FILES0_FROM:
-	    if (usefulFilesCount < USEFUL_FILES_MAX) {
-		usefulFilesFrom[usefulFilesCount] = optarg,
-		usefulFilesDelim[usefulFilesCount] = '\0';
-	    }
+	    usefulFilesFrom[usefulFilesCount] = optarg,
+	    usefulFilesDelim[usefulFilesCount] = '\0';
 	    usefulFilesCount++;
 	    break;
+	case OPT_USEFUL_FILES_FP:
+	    usefulFilesFp[usefulFilesFpCount++] = optarg;
+	    break;
+	case OPT_COMPILE_USEFUL_FILES:
+	    compileTo = optarg;
+	    break;
+	case 'j': {
+	    char *end;
+	    long n = strtol(optarg, &end, 10);
+	    if (end == optarg || *end || n < 1 || n > 256)
+		die("bad --jobs value: %s", optarg);
+	    njobs = n;
+	    break;
+	}
 	default:
-	    fprintf(stderr, "Usage: %s [OPTIONS...] [ARGS...]\n", PROG);
+usage:	    fprintf(stderr, "Usage: %s [OPTIONS...] [ARGS...]\n", PROG);
 	    return 1;
 	}
     }
 
     argc -= optind, argv += optind;
 
-    if (usefulFilesCount) {
+    // With --compile-useful-files, just write the fingerprints.
+    if (compileTo) {
+	if (argc) {
+	    warn("too many arguments");
+	    goto usage;
+	}
+	for (size_t i = 0; i < usefulFilesFpCount; i++)
+	    loadDepFilesFp(usefulFilesFp[i]);
+	for (size_t i = 0; i < usefulFilesCount; i++)
+	    readDepFiles(usefulFilesFrom[i], usefulFilesDelim[i]);
+	writeDepFilesFp(compileTo);
+	return 0;
+    }
+
+    // With --export-cache or --import-cache, just deal with the cache.
+    if (exportTo || importFrom) {
+	if (argc) {
+	    warn("too many arguments");
+	    goto usage;
+	}
+	if (importFrom)
+	    md5cache_import(importFrom);
+	if (exportTo)
+	    md5cache_export(exportTo);
+	return 0;
+    }
+
+    if (argc < 2) {
+	warn("not enough arguments");
+	goto usage;
+    }
+
+    // Before the cache is opened.
+    if (compactCache)
+	md5cache_compact();
+
+    if (usefulFilesCount + usefulFilesFpCount) {
 	if (bloat)
 	    warn("--useful-files redundant with --bloat");
-	else if (usefulFilesCount > USEFUL_FILES_MAX)
-	    die("too may --useful-files options");
 	else {
+	    // The fingerprint files go first, since their seed is adopted.
+	    for (size_t i = 0; i < usefulFilesFpCount; i++)
+		loadDepFilesFp(usefulFilesFp[i]);
 	    for (size_t i = 0; i < usefulFilesCount; i++)
 		readDepFiles(usefulFilesFrom[i], usefulFilesDelim[i]);
 	}
     }
 
+    // Open previous output.  The headers are looked up by filename in the
+    // order of rpms[], which is not the order of pkglist, hence the index.
+    // The mapping lets the file lists be stripped in place, without copying.
+    struct prevout *prevout = prevout_from ?
+	prevout_open(prevout_from, PREVOUT_INDEX | PREVOUT_MMAP) : NULL;
+
+    // Open the repo dir.
+    const char *dir = argv[0];
+    int dirfd = open(dir, O_RDONLY | O_NONBLOCK | O_DIRECTORY);
+    if (dirfd < 0)
+	die("%s: %m", dir);
+
+    // Check the component name.
+    const char *comp = argv[1];
+    size_t complen = strlen(comp);
+    assert(complen + sizeof "pkglist..zst" - 1 < NAME_MAX);
+
+    // Make RPMS.comp name.
+    char rpmdir[complen + sizeof "RPMS."];
+    memcpy(rpmdir, "RPMS.", sizeof "RPMS." - 1);
+    memcpy(rpmdir + sizeof "RPMS." - 1, comp, complen + 1);
+    // Open RPMS.comp dir.
+    int rpmdirfd = openat(dirfd, rpmdir, O_RDONLY | O_NONBLOCK | O_DIRECTORY);
+    if (rpmdirfd < 0)
+	die("%s/%s: %m", dir, rpmdir);
+
+    // Make pkglist.comp.zst name.
+    char pkglist[complen + sizeof "base/pkglist..zst"];
+    memcpy(pkglist, "base/pkglist.", sizeof "base/pkglist." - 1);
+    memcpy(pkglist + sizeof "base/pkglist." - 1, comp, complen);
+    memcpy(pkglist + sizeof "base/pkglist." - 1 + complen, ".zst", sizeof ".zst");
+    // Support inplace update.
+    unlinkat(dirfd, pkglist, 0);
+    // Open pkglist.comp.zst for writing.
+    int outfd = openat(dirfd, pkglist, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (outfd < 0)
+	die("%s/%s: %m", dir, pkglist);
+
+    // Start the output stage.
+    struct outpipe *out = outpipe_open(outfd, pkglist);
+
+    // Repo dirfd no longer needed.
+    close(dirfd);
+
+    // Relative to the original cwd, hence before chdir.
+    if (seedFrom)
+	seedCache(seedFrom, rpmdirfd);
+
+    // Chdir to RPMS.comp.
+    if (fchdir(rpmdirfd) < 0)
+	die("%s/%s: %m", dir, rpmdir);
+
+    // Load rpms (rpmdirfd will be closed).
+    loadDir(rpmdirfd);
+
+    // In the background, until the headers are read.
+    if (scrubRate)
+	md5cache_scrub_start(nrpm, (const char *const *) rpms, scrubRate);
+
+    // Pick up the headers from the previous output.  The rpms which are
+    // not found make up the todo list.
+    blobs = xmalloc(nrpm * sizeof *blobs);
+    size_t *todo = xmalloc(nrpm * sizeof *todo);
+    size_t ntodo = 0;
+    for (size_t i = 0; i < nrpm; i++) {
+	const char *rpm = rpms[i];
+	blobs[i].blob = NULL;
+	blobs[i].blobSize = 0;
+	blobs[i].own = false;
+	if (prevout) {
+	    struct prevhdr *h = prevout_find_pkg(prevout, rpm);
+	    // The header must have the same credentials.
+	    if (h && h->sha256 != sha256)
+		h = NULL;
+	    if (h) {
+		struct stat st;
+		int rc = stat(rpm, &st);
+		if (rc < 0)
+		    die("%s: %m", rpm);
+		if (h->fsize != (unsigned) st.st_size)
+		    die("%s: file size mismatch", rpm);
+		blobs[i].blob = h->blob;
+		blobs[i].blobSize = h->blobSize;
+	    }
+	}
+	if (!blobs[i].blob)
+	    todo[ntodo++] = i;
+    }
+
+    // Compute the missing md5 sums ahead of time.
+    struct prewarmArg parg = { rpms, todo, ntodo, sha256 };
+    jobs_run(njobs, prewarmCount(ntodo), prewarmJob, &parg);
+    md5cache_flush();
+
+    // Read the rest of the headers.
+    struct makeBlobArg arg = { rpmdir, todo, ntodo };
+    fds = xmalloc(nrpm * sizeof *fds);
+    for (size_t i = 0; i < nrpm; i++)
+	fds[i] = -1;
+    for (size_t k = 0; k < NPREFETCH && k < ntodo; k++)
+	prefetch(rpms, todo[k]);
+    jobs_run(njobs, ntodo, makeBlobJob, &arg);
+    md5cache_scrub_stop();
+    md5cache_flush();
+
+    // The file lists depend on every other header, hence the two passes,
+    // with a barrier in between.
+    if (!bloat) {
+	if (depstateFile) {
+	    // Only the packages which are new since the last run are scanned.
+	    struct depstate *ds = depstate_open(depstateFile);
+	    size_t *scan = xmalloc(nrpm * sizeof *scan);
+	    struct stat *scanst = xmalloc(nrpm * sizeof *scanst);
+	    size_t nscan = 0;
+	    for (size_t i = 0; i < nrpm; i++) {
+		struct stat *st = &scanst[nscan];
+		if (stat(rpms[i], st) < 0)
+		    die("%s: %m", rpms[i]);
+		if (!depstate_keep(ds, rpms[i], st))
+		    scan[nscan++] = i;
+	    }
+	    struct depList *lists = xmalloc(nscan * sizeof *lists);
+	    memset(lists, 0, nscan * sizeof *lists);
+	    struct listDepsArg a = { scan, lists };
+	    jobs_run(njobs, nscan, listDepsJob, &a);
+	    for (size_t k = 0; k < nscan; k++) {
+		depstate_add(ds, rpms[scan[k]], &scanst[k], lists[k].argz, lists[k].len);
+		free(lists[k].argz);
+	    }
+	    depstate_commit(ds);
+	    depstate_close(ds);
+	    free(scan);
+	    free(scanst);
+	    free(lists);
+	}
+	else {
+	    jobs_run(njobs, nrpm, findDepFilesJob, NULL);
+	    mergeDepFiles();
+	}
+	jobs_run(njobs, nrpm, stripFileListJob, NULL);
+    }
+
+    // Headers are grouped by src.rpm, then sorted by filename.
+    const char **srcs = xmalloc(nrpm * sizeof *srcs);
+    size_t *order = xmalloc(nrpm * sizeof *order);
+    for (size_t i = 0; i < nrpm; i++) {
+	srcs[i] = sourceRpm(blobs[i].blob);
+	order[i] = i;
+    }
+    size_t tmp;
+#define order_cmp(i, j) strcmp(srcs[order[i]], srcs[order[j]])
+#define order_less(i, j) (order_cmp(i, j) < 0 || \
+	(order_cmp(i, j) == 0 && order[i] < order[j]))
+#define order_swap(i, j) tmp = order[i], order[i] = order[j], order[j] = tmp
+    QSORT(nrpm, order_less, order_swap);
+
+    // Output.
+    for (size_t k = 0; k < nrpm; k++) {
+	struct blob *b = &blobs[order[k]];
+	outpipe_put(out, b->blob, b->blobSize, b->own);
+    }
+
+    // The mapped blobs must stay valid until the output is done.
+    outpipe_close(out);
+    prevout_close(prevout);
+    free(blobs);
+    free(todo);
+    free(fds);
+    free(srcs);
+    free(order);
     return 0;
 }
 
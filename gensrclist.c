@@ -64,6 +64,7 @@ static void loadDir(int dirfd)
 #include "crpmtag.h"
 #include "errexit.h"
 #include "md5cache.h"
+#include "projblob.h"
 
 static const int tags[] = {
     RPMTAG_NAME,
@@ -85,39 +86,49 @@ static const int tags[] = {
     RPMTAG_REQUIREVERSION,
 };
 
-static void *makeBlob(const char *srpmdir, const char *srpm, size_t *sizep)
+// With --sha256, CRPMTAG_SHA256 is added to the credentials.
+static int sha256;
+
+static void *makeBlob(const char *srpmdir, const char *srpm, int fd, size_t *sizep)
 {
-    // Load h1.
-    FD_t FD = Fopen(srpm, "r");
-    if (!FD)
-	die("%s: %m", srpm);
-    Header h1 = readHeader(srpm, FD);
-    if (!h1)
+    // Load the raw header.
+    size_t blobSize;
+    void *blob = readHeaderBlob(srpm, fd, &blobSize);
+    if (!blob)
 	die("%s: cannot read package header", srpm);
-    // Copy to h2.
-    Header h2 = headerNew();
-    assert(h2);
-    copyTags(h1, h2, tags, sizeof tags / sizeof *tags);
-    headerFree(h1);
-    // Add credentials.
-    addStringTag(h2, CRPMTAG_DIRECTORY, srpmdir);
-    addStringTag(h2, CRPMTAG_FILENAME, srpm);
+    // Prepare credentials.
     struct stat st;
-    int fd = Fileno(FD);
     int rc = fstat(fd, &st);
     assert(rc == 0);
-    addUint32Tag(h2, CRPMTAG_FILESIZE, st.st_size);
-    // Add CRPMTAG_MD5.
-    char md5[33];
-    md5cache(srpm, &st, fd, md5);
-    addStringTag(h2, CRPMTAG_MD5, md5);
-    Fclose(FD);
-    // Unload h2.
-    unsigned blobSize;
-    void *blob = headerExport(h2, &blobSize);
-    assert(blob);
-    headerFree(h2);
-    *sizep = blobSize;
+    char md5[33], sha[65];
+    md5cache(srpm, &st, fd, md5, sha256 ? sha : NULL);
+    struct blobcred cred = { srpmdir, srpm, st.st_size, md5, sha256 ? sha : NULL };
+    // Make the output blob.
+    void *blob2 = projectBlob(blob, blobSize, tags, sizeof tags / sizeof *tags,
+			      &cred, sizep);
+    if (!blob2)
+	die("%s: bad package header", srpm);
+    free(blob);
+    return blob2;
+}
+
+// With --jobs, makeBlob runs on behalf of worker threads.
+struct makeBlobArg {
+    const char *srpmdir;
+    // Indexes into srpms[] which were not picked up from the previous output.
+    size_t *todo, ntodo;
+};
+
+static void *makeBlobJob(void *arg, size_t k, size_t *sizep)
+{
+    struct makeBlobArg *a = arg;
+    // Prefetch the next few headers.
+    if (k + NPREFETCH < a->ntodo)
+	prefetch(srpms, a->todo[k+NPREFETCH]);
+    size_t i = a->todo[k];
+    int fd = takeFd(srpms, i);
+    void *blob = makeBlob(a->srpmdir, srpms[i], fd, sizep);
+    close(fd);
     return blob;
 }
 
@@ -126,19 +137,34 @@ static void *makeBlob(const char *srpmdir, const char *srpm, size_t *sizep)
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include "prevout.h"
+#include "jobs.h"
+#include "outpipe.h"
 
 enum {
     OPT_FLAT = 256,
     OPT_PREV_OUT,
+    OPT_SEED_CACHE,
+    OPT_EXPORT_CACHE,
+    OPT_IMPORT_CACHE,
+    OPT_SCRUB,
 };
 
 static int flat;
+static int compactCache;
 
 static const struct option longopts[] = {
     { "help", no_argument, NULL, 'h' },
     { "flat", no_argument, &flat, 1 },
     { "use-prev-output", required_argument, NULL, OPT_PREV_OUT },
+    { "sha256", no_argument, &sha256, 1 },
+    { "direct-io", no_argument, &md5cache_odirect, 1 },
+    { "inode-cache", no_argument, &md5cache_inode, 1 },
+    { "compact-cache", no_argument, &compactCache, 1 },
+    { "seed-cache", required_argument, NULL, OPT_SEED_CACHE },
+    { "export-cache", required_argument, NULL, OPT_EXPORT_CACHE },
+    { "import-cache", required_argument, NULL, OPT_IMPORT_CACHE },
+    { "scrub", required_argument, NULL, OPT_SCRUB },
+    { "jobs", required_argument, NULL, 'j' },
     { NULL },
 };
 
@@ -146,26 +172,74 @@ int main(int argc, char **argv)
 {
     int c;
     const char *prevout_from = NULL;
-    while ((c = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+    const char *seedFrom = NULL;
+    const char *exportTo = NULL;
+    const char *importFrom = NULL;
+    double scrubRate = 0;
+    int njobs = 1;
+    while ((c = getopt_long(argc, argv, "hj:", longopts, NULL)) != -1) {
 	switch (c) {
 	case 0:
 	    break;
 	case OPT_PREV_OUT:
 	    prevout_from = optarg;
 	    break;
+	case OPT_SEED_CACHE:
+	    seedFrom = optarg;
+	    break;
+	case OPT_EXPORT_CACHE:
+	    exportTo = optarg;
+	    break;
+	case OPT_IMPORT_CACHE:
+	    importFrom = optarg;
+	    break;
+	case OPT_SCRUB: {
+	    // Megabytes per second.
+	    char *end;
+	    scrubRate = strtod(optarg, &end);
+	    if (end == optarg || *end || !(scrubRate > 0))
+		die("bad --scrub value: %s", optarg);
+	    break;
+	}
+	case 'j': {
+	    char *end;
+	    long n = strtol(optarg, &end, 10);
+	    if (end == optarg || *end || n < 1 || n > 256)
+		die("bad --jobs value: %s", optarg);
+	    njobs = n;
+	    break;
+	}
 	default:
 usage:	    fprintf(stderr, "Usage: %s [OPTIONS...] [ARGS...]\n", PROG);
 	    return 1;
 	}
     }
     argc -= optind, argv += optind;
+
+    // With --export-cache or --import-cache, just deal with the cache.
+    if (exportTo || importFrom) {
+	if (argc) {
+	    warn("too many arguments");
+	    goto usage;
+	}
+	if (importFrom)
+	    md5cache_import(importFrom);
+	if (exportTo)
+	    md5cache_export(exportTo);
+	return 0;
+    }
+
     if (argc < 2) {
 	warn("not enough arguments");
 	goto usage;
     }
 
+    // Before the cache is opened.
+    if (compactCache)
+	md5cache_compact();
+
     // Open previous output.
-    struct prevout *prevout = prevout_from ? prevout_open(prevout_from) : NULL;
+    struct prevout *prevout = prevout_from ? prevout_open(prevout_from, 0) : NULL;
 
     // Open the repo dir.  I don't want to mess with snprintf or strcat
     // to make full paths, I would rather use openat(2) with dirfd.
@@ -200,9 +274,16 @@ usage:	    fprintf(stderr, "Usage: %s [OPTIONS...] [ARGS...]\n", PROG);
     if (outfd < 0)
 	die("%s/%s: %m", dir, srclist);
 
+    // Start the output stage.
+    struct outpipe *out = outpipe_open(outfd, srclist);
+
     // Repo dirfd no longer needed.
     close(dirfd);
 
+    // Relative to the original cwd, hence before chdir.
+    if (seedFrom)
+	seedCache(seedFrom, srpmdirfd);
+
     // Chdir to SRPMS.comp.
     if (fchdir(srpmdirfd) < 0)
 	die("%s/%s: %m", dir, srpmdir);
@@ -210,31 +291,88 @@ usage:	    fprintf(stderr, "Usage: %s [OPTIONS...] [ARGS...]\n", PROG);
     // Load srpms (srpmdirfd will be closed).
     loadDir(srpmdirfd);
 
-    // The main loop.
+    // In the background, until the srclist is done.
+    if (scrubRate)
+	md5cache_scrub_start(nsrpm, (const char *const *) srpms, scrubRate);
+
+    // Find out which headers can be picked up from the previous output.
+    // This has to be done sequentially, because prevout_find_src is
+    // a merge-like walk.  The srpms which are not found make up the todo
+    // list, to be processed with makeBlob (possibly in parallel).  The blobs
+    // are not kept: the previous output is walked again in the main loop,
+    // so that only one reused blob at a time is held in memory.
+    size_t *todo = xmalloc(nsrpm * sizeof *todo);
+    size_t ntodo = 0;
     for (size_t i = 0; i < nsrpm; i++) {
 	const char *srpm = srpms[i];
-	void *blob = NULL;
-	size_t blobSize = 0;
+	bool reuse = false;
 	if (prevout) {
 	    struct prevhdr *h = prevout_find_src(prevout, srpm);
-	    if (h) {
+	    // The header must have the same credentials.
+	    if (h && h->sha256 == sha256) {
 		struct stat st;
 		int rc = stat(srpm, &st);
 		if (rc < 0)
 		    die("%s: %m", srpm);
 		if (h->fsize != (unsigned) st.st_size)
 		    die("%s: file size mismatch", srpm);
-		blob = h->blob, h->blob = NULL;
-		blobSize = h->blobSize;
+		reuse = true;
 	    }
+	    if (h)
+		free(h->blob), h->blob = NULL;
+	}
+	if (!reuse)
+	    todo[ntodo++] = i;
+    }
+    if (prevout)
+	prevout_rewind(prevout);
+
+    // Compute the missing md5 sums ahead of time.
+    struct prewarmArg parg = { srpms, todo, ntodo, sha256 };
+    jobs_run(njobs, prewarmCount(ntodo), prewarmJob, &parg);
+    md5cache_flush();
+
+    // Worker threads run makeBlob on the todo list.  The results are
+    // retrieved in the same order, so the output is the same as with
+    // the serial run.
+    struct makeBlobArg arg = { srpmdir, todo, ntodo };
+    fds = xmalloc(nsrpm * sizeof *fds);
+    for (size_t i = 0; i < nsrpm; i++)
+	fds[i] = -1;
+    for (size_t k = 0; k < NPREFETCH && k < ntodo; k++)
+	prefetch(srpms, todo[k]);
+    struct jobs *jobs = NULL;
+    if (njobs > 1 && ntodo > 1)
+	jobs = jobs_start(njobs < ntodo ? njobs : ntodo, ntodo, makeBlobJob, &arg);
+
+    // The main loop.
+    for (size_t i = 0, k = 0; i < nsrpm; i++) {
+	void *blob;
+	size_t blobSize;
+	if (k < ntodo && todo[k] == i) {
+	    if (jobs)
+		blob = jobs_next(jobs, &blobSize);
+	    else
+		blob = makeBlobJob(&arg, k, &blobSize);
+	    k++;
+	}
+	else {
+	    // Found on the first walk, hence found again.
+	    struct prevhdr *h = prevout_find_src(prevout, srpms[i]);
+	    assert(h && h->blob);
+	    blob = h->blob, h->blob = NULL;
+	    blobSize = h->blobSize;
 	}
-	if (!blob)
-	    blob = makeBlob(srpmdir, srpm, &blobSize);
-	// TODO: wirte the blob.
-	free(blob);
+	outpipe_put(out, blob, blobSize, true);
     }
 
     prevout_close(prevout);
+    jobs_finish(jobs);
+    md5cache_scrub_stop();
+    md5cache_flush();
+    outpipe_close(out);
+    free(todo);
+    free(fds);
     return 0;
 }
 
@@ -19,58 +19,226 @@
 // SOFTWARE.
 
 #include <assert.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <rpm/rpmlib.h>
-#include <rpm/rpmts.h>
+#include "errexit.h"
 
-static Header readHeader(const char *rpm, FD_t FD)
+// Like pread(2), but retries on short reads.  Returns the number of bytes
+// read, which is less than size only on EOF, or -1 on error.
+static ssize_t xpread(int fd, void *buf, size_t size, off_t off)
 {
-    static rpmts ts;
-    if (ts == NULL) {
-	//rpmReadConfigFiles(NULL, NULL);
-	ts = rpmtsCreate();
-	assert(ts);
-	rpmtsSetVSFlags(ts, (rpmVSFlags) -1);
+    size_t total = 0;
+    while (total < size) {
+	ssize_t ret = pread(fd, (char *) buf + total, size - total, off + total);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (ret == 0)
+	    break;
+	total += ret;
     }
-    Header h = NULL;
-    int rc = rpmReadPackageFile(ts, FD, rpm, &h);
-    if (rc == RPMRC_OK || rc == RPMRC_NOTTRUSTED || rc == RPMRC_NOKEY)
-	return h;
-    return NULL;
+    return total;
 }
 
-static void copyTag(Header h1, Header h2, int tag)
+// An rpm file starts with the lead, followed by the signature header
+// and the header proper, followed by the payload.
+#define LEAD_SIZE 96
+static const unsigned char leadMagic[4] = { 0xed, 0xab, 0xee, 0xdb };
+// Each header starts with the magic, followed by il and dl (the number
+// of index entries and the size of data).
+static const unsigned char headerMagic[8] = { 0x8e, 0xad, 0xe8, 0x01, 0, 0, 0, 0 };
+// The limits are the same as in librpm.
+#define SIG_IL_MAX 32
+#define SIG_DL_MAX (64<<20)
+#define HDR_IL_MAX 0xffff
+#define HDR_DL_MAX (256<<20)
+
+// Check the header magic and load il+dl.
+static bool headerIntro(const unsigned char *p, unsigned *il, unsigned *dl)
 {
-    struct rpmtd_s td;
-    // Copy raw entry, so that internationalized strings
-    // will get copied correctly.
-    int rc = headerGet(h1, tag, &td, HEADERGET_MINMEM | HEADERGET_RAW);
-    if (rc == 1) {
-	rc = headerPut(h2, &td, HEADERPUT_DEFAULT);
-	assert(rc == 1);
-	rpmtdFreeData(&td);
+    if (memcmp(p, headerMagic, 4))
+	return false;
+    memcpy(il, p + 8, 4), *il = ntohl(*il);
+    memcpy(dl, p + 12, 4), *dl = ntohl(*dl);
+    return true;
+}
+
+// Read the header blob from an rpm file, without going through librpm
+// and its FD_t machinery.  Only the bytes up to the end of the header are
+// read, with pread(2), so the payload is never touched (well, except for
+// the page where the header ends).  Returns a malloc'd blob, which can be
+// fed to headerImport, or NULL if the file does not look like an rpm.
+// Dies on I/O error.
+static void *readHeaderBlob(const char *rpm, int fd, size_t *sizep)
+{
+    // We read exactly what's needed, so the kernel's readahead would
+    // only pull in the payload.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    // A single read will normally cover the lead and the signature,
+    // and possibly the beginning of the header.
+    unsigned char buf[4096];
+    ssize_t n = xpread(fd, buf, sizeof buf, 0);
+    if (n < 0)
+	die("%s: %m", rpm);
+    void *blob = NULL;
+    unsigned il, dl;
+    if (n < LEAD_SIZE + 16 || memcmp(buf, leadMagic, 4))
+	goto out;
+    // The signature header is padded to an 8-byte boundary.
+    if (!headerIntro(buf + LEAD_SIZE, &il, &dl))
+	goto out;
+    if (il > SIG_IL_MAX || dl > SIG_DL_MAX)
+	goto out;
+    size_t sigSize = 16 + 16 * il + dl;
+    off_t hoff = LEAD_SIZE + sigSize + (8 - sigSize % 8) % 8;
+    // The header intro.
+    unsigned char intro[16];
+    if (hoff + 16 <= n)
+	memcpy(intro, buf + hoff, 16);
+    else {
+	ssize_t ret = xpread(fd, intro, 16, hoff);
+	if (ret < 0)
+	    die("%s: %m", rpm);
+	if (ret < 16)
+	    goto out;
+    }
+    if (!headerIntro(intro, &il, &dl))
+	goto out;
+    if (il == 0 || il > HDR_IL_MAX || dl > HDR_DL_MAX)
+	goto out;
+    // The blob is the header without the magic.
+    size_t blobSize = 8 + 16 * il + dl;
+    blob = xmalloc(blobSize);
+    // Some of it may have already been read.
+    off_t boff = hoff + 8;
+    size_t got = 0;
+    if (boff < n) {
+	got = n - boff;
+	if (got > blobSize)
+	    got = blobSize;
+	memcpy(blob, buf + boff, got);
+    }
+    ssize_t ret = xpread(fd, (char *) blob + got, blobSize - got, boff + got);
+    if (ret < 0)
+	die("%s: %m", rpm);
+    if (ret < blobSize - got) {
+	free(blob);
+	blob = NULL;
+	goto out;
     }
+    *sizep = blobSize;
+out:
+    // Back to normal, in case the file is going to be read sequentially
+    // (e.g. by md5fd).
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+    return blob;
 }
 
-static void copyTags(Header h1, Header h2, const int tags[], int ntag)
+// Ask the kernel to start reading the header of an rpm file which is going
+// to be processed shortly.  This is mostly for NFS-backed repos, where each
+// read is a round trip.  Headers are typically well within the first 64K.
+static void prefetchHeader(int fd)
 {
-    for (int i = 0; i < ntag; i++)
-	copyTag(h1, h2, tags[i]);
+    posix_fadvise(fd, 0, 64<<10, POSIX_FADV_WILLNEED);
 }
 
-static void addStringTag(Header h, int tag, const char *str)
+// File descriptors of the rpms which are going to be processed shortly,
+// indexed the same way as the names[] array of rpm filenames.  A slot is -1
+// if the file has not been opened yet, and FD_TAKEN once the descriptor is
+// taken over by the caller.  Since the slots are updated atomically, there
+// are no locks, even with --jobs.
+static int *fds;
+#define FD_TAKEN (-2)
+
+// How far ahead the files are opened and prefetched.
+#define NPREFETCH 8
+
+static void prefetch(char *names[], size_t i)
 {
-    struct rpmtd_s td = { .tag = tag, .type = RPM_STRING_TYPE,
-			  .data = (char *) str, .count = 1 };
-    int rc = headerPut(h, &td, HEADERPUT_DEFAULT);
-    assert(rc == 1);
+    if (__atomic_load_n(&fds[i], __ATOMIC_RELAXED) != -1)
+	return;
+    int fd = open(names[i], O_RDONLY);
+    // Errors will be reported by takeFd.
+    if (fd < 0)
+	return;
+    prefetchHeader(fd);
+    int expected = -1;
+    if (!__atomic_compare_exchange_n(&fds[i], &expected, fd, false,
+				     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	close(fd);
 }
 
-static void addUint32Tag(Header h, int tag, unsigned val)
+static int takeFd(char *names[], size_t i)
 {
-    struct rpmtd_s td = { .tag = tag, .type = RPM_INT32_TYPE,
-			  .data = &val, .count = 1 };
-    int rc = headerPut(h, &td, HEADERPUT_DEFAULT);
-    assert(rc == 1);
+    int fd = __atomic_exchange_n(&fds[i], FD_TAKEN, __ATOMIC_ACQUIRE);
+    assert(fd != FD_TAKEN);
+    if (fd < 0) {
+	fd = open(names[i], O_RDONLY);
+	if (fd < 0)
+	    die("%s: %m", names[i]);
+    }
+    return fd;
+}
+
+#include "md5cache.h"
+
+// Before the headers are read, md5cache is warmed up in batches,
+// possibly in parallel (with jobs_run), see md5cache_prewarm.
+#define PREWARM_BATCH 64
+
+struct prewarmArg {
+    char **names;
+    // Indexes into names[] which are going to be processed.
+    size_t *todo, ntodo;
+    // Also compute sha256.
+    bool sha256;
+};
+
+static inline size_t prewarmCount(size_t ntodo)
+{
+    return (ntodo + PREWARM_BATCH - 1) / PREWARM_BATCH;
+}
+
+static void *prewarmJob(void *arg, size_t k, size_t *sizep)
+{
+    struct prewarmArg *a = arg;
+    size_t lo = k * PREWARM_BATCH;
+    size_t hi = lo + PREWARM_BATCH < a->ntodo ? lo + PREWARM_BATCH : a->ntodo;
+    const char *batch[PREWARM_BATCH];
+    for (size_t j = lo; j < hi; j++)
+	batch[j-lo] = a->names[a->todo[j]];
+    md5cache_prewarm(hi - lo, batch, a->sha256);
+    return NULL;
+}
+
+#include <sys/stat.h>
+#include "prevout.h"
+
+// With --seed-cache, the md5cache is first filled from the previous output,
+// for the packages in dirfd which still have the same size (mtime is then
+// taken from the disk).  This saves hashing everything anew
+// on a new host, where the previous output is shipped along with the repo.
+static void seedCache(const char *from, int dirfd)
+{
+    struct prevout *prevout = prevout_open(from, 0);
+    if (!prevout)
+	return;
+    struct prevhdr *h;
+    while ((h = prevout_next(prevout))) {
+	struct stat st;
+	if (fstatat(dirfd, h->rpm, &st, 0) == 0 && S_ISREG(st.st_mode) && st.st_size == h->fsize)
+	    md5cache_seed(h->rpm, &st, h->md5, h->sha);
+	free(h->blob);
+    }
+    prevout_close(prevout);
+    md5cache_flush();
 }
 
 // ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,173 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "errexit.h"
+#include "jobs.h"
+
+// A slot in the reorder buffer.
+struct slot {
+    void *res;
+    size_t size;
+    bool done;
+};
+
+struct jobs {
+    pthread_mutex_t mutex;
+    // The consumer waits for the result at the head of the buffer;
+    // the workers wait for the room in the buffer.
+    pthread_cond_t done, room;
+    // The next index to be claimed by a worker, and the next index
+    // to be retrieved by the consumer.
+    size_t claim, consume;
+    size_t n;
+    jobs_work_t work;
+    void *arg;
+    int nthr;
+    pthread_t *thr;
+    // The reorder buffer, indexed with i % nslot.
+    size_t nslot;
+    struct slot slots[];
+};
+
+static void *worker(void *arg)
+{
+    struct jobs *j = arg;
+    pthread_mutex_lock(&j->mutex);
+    while (1) {
+	// Don't run too far ahead of the consumer: the slot for this
+	// index must have been vacated.
+	while (j->claim < j->n && j->claim >= j->consume + j->nslot)
+	    pthread_cond_wait(&j->room, &j->mutex);
+	if (j->claim == j->n)
+	    break;
+	size_t i = j->claim++;
+	pthread_mutex_unlock(&j->mutex);
+	size_t size = 0;
+	void *res = j->work(j->arg, i, &size);
+	pthread_mutex_lock(&j->mutex);
+	struct slot *s = &j->slots[i % j->nslot];
+	assert(!s->done);
+	s->res = res, s->size = size, s->done = true;
+	// Only the head of the buffer is of interest to the consumer.
+	if (i == j->consume)
+	    pthread_cond_signal(&j->done);
+    }
+    pthread_mutex_unlock(&j->mutex);
+    return NULL;
+}
+
+struct jobs *jobs_start(int njobs, size_t n, jobs_work_t work, void *arg)
+{
+    assert(njobs > 0);
+    // A few slots per thread is enough to smooth out the variance
+    // in processing time (there are a few huge packages).
+    size_t nslot = 8 * (size_t) njobs;
+    struct jobs *j = xmalloc(sizeof *j + nslot * sizeof(struct slot));
+    memset(j->slots, 0, nslot * sizeof(struct slot));
+    pthread_mutex_init(&j->mutex, NULL);
+    pthread_cond_init(&j->done, NULL);
+    pthread_cond_init(&j->room, NULL);
+    j->claim = j->consume = 0;
+    j->n = n;
+    j->work = work;
+    j->arg = arg;
+    j->nslot = nslot;
+    j->thr = xmalloc(njobs * sizeof(pthread_t));
+    for (j->nthr = 0; j->nthr < njobs; j->nthr++) {
+	int rc = pthread_create(&j->thr[j->nthr], NULL, worker, j);
+	if (rc)
+	    die("%s: %s", "pthread_create", strerror(rc));
+    }
+    return j;
+}
+
+void *jobs_next(struct jobs *j, size_t *sizep)
+{
+    pthread_mutex_lock(&j->mutex);
+    assert(j->consume < j->n);
+    struct slot *s = &j->slots[j->consume % j->nslot];
+    while (!s->done)
+	pthread_cond_wait(&j->done, &j->mutex);
+    void *res = s->res;
+    *sizep = s->size;
+    s->done = false;
+    j->consume++;
+    // The slot has been vacated.
+    pthread_cond_broadcast(&j->room);
+    pthread_mutex_unlock(&j->mutex);
+    return res;
+}
+
+void jobs_finish(struct jobs *j)
+{
+    if (!j)
+	return;
+    assert(j->consume == j->n);
+    for (int i = 0; i < j->nthr; i++)
+	pthread_join(j->thr[i], NULL);
+    pthread_mutex_destroy(&j->mutex);
+    pthread_cond_destroy(&j->done);
+    pthread_cond_destroy(&j->room);
+    free(j->thr);
+    free(j);
+}
+
+// Since the results are discarded, jobs_run needs no reorder buffer:
+// the threads just claim the indices from a shared counter, each going
+// at its own pace.
+struct runner {
+    size_t claim;
+    size_t n;
+    jobs_work_t work;
+    void *arg;
+};
+
+static void *runWorker(void *arg)
+{
+    struct runner *r = arg;
+    size_t i, size;
+    while ((i = __atomic_fetch_add(&r->claim, 1, __ATOMIC_RELAXED)) < r->n)
+	r->work(r->arg, i, &size);
+    return NULL;
+}
+
+void jobs_run(int njobs, size_t n, jobs_work_t work, void *arg)
+{
+    assert(njobs > 0);
+    if ((size_t) njobs > n)
+	njobs = n;
+    struct runner r = { 0, n, work, arg };
+    // The calling thread is one of the workers.
+    pthread_t thr[njobs > 1 ? njobs - 1 : 1];
+    for (int k = 0; k < njobs - 1; k++) {
+	int rc = pthread_create(&thr[k], NULL, runWorker, &r);
+	if (rc)
+	    die("%s: %s", "pthread_create", strerror(rc));
+    }
+    runWorker(&r);
+    for (int k = 0; k < njobs - 1; k++)
+	pthread_join(thr[k], NULL);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
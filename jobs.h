@@ -0,0 +1,44 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stddef.h>
+
+// The worker function, called for each i in [0, n) on behalf of some worker
+// thread.  Returns a blob (or whatever the caller makes of it) and its size.
+typedef void *(*jobs_work_t)(void *arg, size_t i, size_t *sizep);
+
+// Start njobs worker threads which will run work(arg, i) for each i in
+// [0, n), roughly in ascending order.  Dies on error.
+struct jobs *jobs_start(int njobs, size_t n, jobs_work_t work, void *arg);
+
+// Retrieve the results strictly in the original order, i.e. the first call
+// returns the result for i = 0, and so on.  Blocks until the result is ready.
+// The workers may run only that far ahead of the consumer, since finished but
+// not yet retrieved results are kept in a bounded reorder buffer.
+void *jobs_next(struct jobs *j, size_t *sizep);
+
+// Join the threads and free the handle.  All the n results must have been
+// retrieved by then.
+void jobs_finish(struct jobs *j);
+
+// Run work(arg, i) for each i in [0, n) and wait until all of it is done,
+// the results being discarded.  This is for passes which update the data
+// in place.  With njobs == 1, runs serially in the calling thread.
+void jobs_run(int njobs, size_t n, jobs_work_t work, void *arg);
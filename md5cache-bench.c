@@ -0,0 +1,190 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// A stress benchmark for md5cache: N processes, each playing the part of
+// a genpkglist run on its own component, hash their rpms into the same
+// ~/.cache/genbasedir at once.  The rpms are small, so that the time goes
+// into the cache rather than into MD5.  Each process goes through its rpms
+// in batches of PREWARM_BATCH, the way genpkglist does, and then flushes.
+// By default, each process has NGROUP times GROUP_MAX rpms, so that most
+// of the records are committed in groups while the processes are still
+// hashing, and contend for the write lock, rather than by the final flush.
+// The second pass finds everything in the cache.  Only the public md5cache
+// API is used, so the driver can be built against older md5cache.c too:
+//
+//	cc -O2 -o md5cache-bench md5cache-bench.c md5cache.c md5mb.c
+//		-lmdbx -lcrypto -lpthread
+//	HOME=/tmp/bench ./md5cache-bench -p 16 /tmp/bench/rpms
+//
+// Set HOME to a scratch directory, or else the bench records end up
+// in the real cache.
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "errexit.h"
+#include "md5cache.h"
+
+#define PREWARM_BATCH 64
+// As in md5cache.c.
+#define GROUP_MAX 4096
+#define NGROUP 4
+
+static double monotime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Make the rpms for process p, unless they are already there.
+// The names must pass md5cache_key, hence the N-V-R.A.rpm form.
+static void makeRpms(const char *dir, int p, size_t n, size_t size, char **names)
+{
+    char sub[PATH_MAX];
+    snprintf(sub, sizeof sub, "%s/c%d", dir, p);
+    if (mkdir(sub, 0777) < 0 && errno != EEXIST)
+	die("%s: %m", sub);
+    int dirfd = open(sub, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0)
+	die("%s: %m", sub);
+    char *buf = xmalloc(size + 1);
+    for (size_t i = 0; i < n; i++) {
+	char name[64];
+	snprintf(name, sizeof name, "bench%d-%zu-1.0-alt1.x86_64.rpm", p, i);
+	names[i] = strdup(name);
+	if (faccessat(dirfd, name, F_OK, 0) == 0)
+	    continue;
+	int len = snprintf(buf, size + 1, "%d %zu ", p, i);
+	memset(buf + len, 'x', size - len);
+	int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+	    die("%s/%s: %m", sub, name);
+	if (write(fd, buf, size) != (ssize_t) size)
+	    die("%s/%s: %m", sub, name);
+	close(fd);
+    }
+    close(dirfd);
+    free(buf);
+}
+
+// The child: one pass over the rpms, returns the elapsed time.
+static double run(const char *dir, int p, size_t n, char **names)
+{
+    char sub[PATH_MAX];
+    snprintf(sub, sizeof sub, "%s/c%d", dir, p);
+    if (chdir(sub) < 0)
+	die("%s: %m", sub);
+    double start = monotime();
+    for (size_t i = 0; i < n; i += PREWARM_BATCH) {
+	size_t k = n - i < PREWARM_BATCH ? n - i : PREWARM_BATCH;
+	md5cache_prewarm(k, (const char *const *) names + i, false);
+    }
+    md5cache_flush();
+    return monotime() - start;
+}
+
+// Fork the processes for one pass, and report their times.
+static void pass(const char *what, const char *dir, int nproc, size_t n, char ***names)
+{
+    int pfd[2];
+    if (pipe(pfd) < 0)
+	die("pipe: %m");
+    // Or else the children would print it again.
+    fflush(stdout);
+    double start = monotime();
+    for (int p = 0; p < nproc; p++) {
+	pid_t pid = fork();
+	if (pid < 0)
+	    die("fork: %m");
+	if (pid == 0) {
+	    close(pfd[0]);
+	    double t = run(dir, p, n, names[p]);
+	    if (write(pfd[1], &t, sizeof t) != sizeof t)
+		die("pipe: %m");
+	    // The cache is committed at exit.
+	    exit(0);
+	}
+    }
+    close(pfd[1]);
+    double t, sum = 0, max = 0;
+    int got = 0;
+    while (read(pfd[0], &t, sizeof t) == sizeof t) {
+	sum += t, got++;
+	if (t > max)
+	    max = t;
+    }
+    close(pfd[0]);
+    int status, failed = 0;
+    while (wait(&status) > 0)
+	failed += !WIFEXITED(status) || WEXITSTATUS(status);
+    double wall = monotime() - start;
+    if (failed || got != nproc)
+	die("%d of %d processes failed", nproc - got, nproc);
+    printf("%s: %d procs x %zu rpms: wall %.3fs, per proc avg %.3fs max %.3fs, %.0f rpms/s\n",
+	   what, nproc, n, wall, sum / got, max, nproc * n / wall);
+}
+
+int main(int argc, char **argv)
+{
+    int nproc = 8;
+    size_t n = NGROUP * GROUP_MAX, size = 1024;
+    int c;
+    while ((c = getopt(argc, argv, "p:n:s:")) != -1) {
+	switch (c) {
+	case 'p':
+	    nproc = atoi(optarg);
+	    break;
+	case 'n':
+	    n = strtoul(optarg, NULL, 0);
+	    break;
+	case 's':
+	    size = strtoul(optarg, NULL, 0);
+	    break;
+	default:
+	    goto usage;
+	}
+    }
+    if (argc - optind != 1 || nproc < 1 || n < 1 || size < 32) {
+usage:	fprintf(stderr, "Usage: %s [-p NPROC] [-n NRPM] [-s SIZE] DIR\n", argv[0]);
+	return 2;
+    }
+    const char *dir = argv[optind];
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+	die("%s: %m", dir);
+    char ***names = xmalloc(nproc * sizeof *names);
+    for (int p = 0; p < nproc; p++) {
+	names[p] = xmalloc(n * sizeof **names);
+	makeRpms(dir, p, n, size, names[p]);
+    }
+    // Let the page cache settle on the new files.
+    sync();
+    pass("cold", dir, nproc, n, names);
+    pass("warm", dir, nproc, n, names);
+    return 0;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
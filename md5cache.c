@@ -37,8 +37,9 @@ static_assert(minRpmLen >= longestSuffix, "string literals compared safely");
 // Additionally a key (typically "N-V-R") should be at least this long.
 #define minKeyLen strLen("a-1-1")
 
-#ifdef MD5CACHE_SRC
-// Source rpms undergo a much simpler .src.rpm suffix removal.
+#if defined(MD5CACHE_SRC) || defined(MD5CACHE_MD5DB)
+// Source rpms undergo a much simpler .src.rpm suffix removal.  With md5db,
+// binary rpms only lose the .rpm suffix, the arch being part of the key.
 #else
 // Split rpm basename, already without .rpm suffix, into even shorter key
 // (without .arch suffix, ending with "-V-R") and arch.
@@ -82,16 +83,20 @@ static bool split_ka(char *rpm, size_t len, char **k, size_t *klen, const char *
 }
 #endif
 
-// The cache database is a stream of cache entries; the stream is further
+#ifdef MD5CACHE_MD5DB
+// With -DMD5CACHE_MD5DB, the cache is built without mdbx.  Instead,
+// the cache database is a stream of cache entries; the stream is further
 // compressed with Zstd, to whom I entrust basic integrity checking such as
 // file magic and checksumming (which is no small matter if you think what
-// happens after we discharge bad md5).
+// happens after we discharge bad md5).  The stream is sorted by key, and is
+// loaded into memory as a whole, and written back (merged) at exit.  This is
+// suited for read-mostly builders, where a lookup is just a binary search.
 //
 // Each entry is:
 // keylen: 1 byte, key: not null-terminated,
 // file size+mtime: packed into 6 bytes,
 // cache entry atime: 2 bytes (unix time >> 16),
-// md5: 16 bytes, sha256: 32 bytes.
+// md5: 16 bytes, sha256: 32 bytes (all zeroes if not computed).
 
 // The "entry value", i.e. the entry save the key.
 struct entv {
@@ -109,11 +114,6 @@ unsigned short now;
 #else
 // Binary repos enjoy moderately larger counts (due to subpackages).
 #define NENT (3<<17)
-// There can also be special binary repos, such as distro's RPMS.main,
-// which are combined of a few repo components (e.g. x86_64, noarch,
-// and i586-arepo).  In other words, we may need to open a few per-arch
-// sub-databases within a single run.
-#define MAXSUBDB 4
 #endif
 
 // The average length of srpm keys is 29, the average length of x86_64 keys
@@ -140,6 +140,7 @@ static inline unsigned addStr(const char *str, size_t len)
 
 struct md5db {
     size_t lend; // loaded from disk
+    size_t send; // added and already sorted
     size_t aend; // added during runtime
     unsigned kk[NENT]; // key indexes into strtab
     struct entv ee[NENT];
@@ -177,6 +178,9 @@ static bool md5db_readloop(struct md5db *db, struct zstdreader *z, const char *e
 	unsigned six = addStr(buf, klen);
 	if (six == -1)
 	    return ERRSTR("too many keys"), false;
+	// md5db_find relies on the order.
+	if (db->lend && strcmp(strtab + db->kk[db->lend-1], strtab + six) >= 0)
+	    return ERRSTR("keys not sorted"), false;
 	db->kk[db->lend] = six;
 	memcpy(db->ee + db->lend, buf + klen, sizeof(struct entv));
 	db->lend++;
@@ -204,13 +208,13 @@ static bool md5db_readall(struct md5db *db, int fd, const char *err[2])
 	    ERRSTR("trailing garbage");
     }
     zstdreader_free(z);
-    db->aend = db->lend;
+    db->send = db->aend = db->lend;
     return ok;
 }
 
-static struct entv *md5db_find(struct md5db *db, const char *key)
+// Binary search in the sorted range [l,u).
+static struct entv *md5db_bsearch(struct md5db *db, size_t l, size_t u, const char *key)
 {
-    size_t l = 0, u = db->lend;
     unsigned *kk = db->kk;
     while (l < u) {
 	size_t i = (l + u) / 2;
@@ -225,6 +229,21 @@ static struct entv *md5db_find(struct md5db *db, const char *key)
     return NULL;
 }
 
+// The entries added since the last md5db_asort are searched linearly,
+// hence md5db_asort is called every so often.
+#define MAXUNSORTED 1024
+
+static struct entv *md5db_find(struct md5db *db, const char *key)
+{
+    struct entv *e = md5db_bsearch(db, 0, db->lend, key);
+    if (!e)
+	e = md5db_bsearch(db, db->lend, db->send, key);
+    for (size_t i = db->send; !e && i < db->aend; i++)
+	if (strcmp(strtab + db->kk[i], key) == 0)
+	    e = &db->ee[i];
+    return e;
+}
+
 #include "qsort.h"
 
 // Sort added entries.
@@ -238,6 +257,7 @@ static void md5db_asort(struct md5db *db)
 		   e = ee[i], ee[i] = ee[j], ee[j] = e
     size_t n = db->aend - db->lend;
     QSORT(n, LESS, SWAP);
+    db->send = db->aend;
 }
 
 #include "zstdwriter.h"
@@ -245,6 +265,85 @@ static void md5db_asort(struct md5db *db)
 // Entries older than about 15 days are purged automatically.
 #define OLD(atime) (atime + 20 < now)
 
+// When the database has been rewritten by another process since it was
+// loaded, the new version is read as z0 and merged on the fly.  This is
+// the lookahead record from z0.
+struct state0 {
+    bool have, eof;
+    unsigned char klen;
+    char k[256];
+    struct entv e;
+};
+
+// Load the next record from z0, unless it has already been loaded.
+static bool md5db_peek0(struct zstdreader *z0, struct state0 *st0, const char *err[2])
+{
+    if (st0->have || st0->eof)
+	return true;
+    unsigned char klen;
+    ssize_t zret = zstdreader_read(z0, &klen, 1, err);
+    if (zret < 0)
+	return false;
+    if (zret == 0)
+	return st0->eof = true;
+    if (klen < minKeyLen)
+	return ERRSTR("bad keylen"), false;
+    char buf[256+sizeof(struct entv)];
+    size_t nread = klen + sizeof(struct entv);
+    zret = zstdreader_read(z0, buf, nread, err);
+    if (zret < 0)
+	return false;
+    if (zret < nread)
+	return ERRSTR("unexpected EOF"), false;
+    memcpy(st0->k, buf, klen);
+    st0->k[klen] = '\0';
+    st0->klen = klen;
+    memcpy(&st0->e, buf + klen, sizeof st0->e);
+    return st0->have = true;
+}
+
+// Pass through the z0 record, unless it's too old.
+static bool md5db_write0(struct zstdwriter *z, struct state0 *st0, const char *err[2])
+{
+    st0->have = false;
+    if (OLD(st0->e.atime))
+	return true;
+    if (!zstdwriter_write(z, &st0->klen, 1, err))
+	return false;
+    if (!zstdwriter_write(z, st0->k, st0->klen, err))
+	return false;
+    if (!zstdwriter_write(z, &st0->e, sizeof st0->e, err))
+	return false;
+    return true;
+}
+
+// Pass through the z0 records up to the key k (or all the remaining records,
+// if k is NULL).  If z0 also has k, its record wins, unless ours is fresh.
+// Returns 1 if k has been written, 0 if k is to be written by the caller,
+// -1 on error.
+static int md5db_catchup(struct zstdwriter *z, struct zstdreader *z0,
+			 struct state0 *st0, const char *k, bool fresh,
+			 const char *err[2])
+{
+    while (1) {
+	if (!md5db_peek0(z0, st0, err))
+	    return -1;
+	if (st0->eof)
+	    return 0;
+	int cmp = k ? strcmp(st0->k, k) : -1;
+	if (cmp > 0)
+	    return 0;
+	if (cmp == 0 && fresh) {
+	    st0->have = false;
+	    return 0;
+	}
+	if (!md5db_write0(z, st0, err))
+	    return -1;
+	if (cmp == 0)
+	    return 1;
+    }
+}
+
 // Process a single key, write a record from the table, unless it's too old.
 // Further merge with the other state, if there is one.  Unless the record
 // is fresh (or has been refreshed via cache hit), prefer to pass through
@@ -296,15 +395,19 @@ static bool md5db_writeloop(struct md5db *db, struct zstdreader *z0,
     for (; j < db->aend; j++)
 	if (!md5db_write1(db, z, z0, &st0, strtab + kk[j], &db->ee[j], err))
 	    return false;
-    // TODO: append the rest of z0.
+    // Append the rest of z0.
+    if (z0 && md5db_catchup(z, z0, &st0, NULL, false, err) < 0)
+	return false;
     return true;
 }
+#endif
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <limits.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <mdbx.h>
+#include <pthread.h>
 #include "errexit.h"
 
 // Separate environments for gensrclist and genpkglist.
@@ -313,26 +416,20 @@ static bool md5db_writeloop(struct md5db *db, struct zstdreader *z0,
 #else
 #define ENV "md5-pkg"
 #endif
-static MDBX_env *env;
-// The read-only transaction for fast retrieval.
-static MDBX_txn *rtxn;
-#ifdef MD5CACHE_SRC
-// The unnamed database for gensrclist.
-static MDBX_dbi src_dbi;
-#endif
 
-// Prepare a NOSUBDIR environment under ~/.cache/genbasedir/.
-static void md5cache_init(void)
+// Make the path to ~/.cache/genbasedir/name, creating the directories
+// as needed.
+static void md5cache_path(char path[PATH_MAX], const char *name)
 {
     const char *home = getenv("HOME");
     assert(home && *home == '/');
     size_t hlen = strlen(home);
+    size_t nlen = strlen(name);
 #define SUBDIR "/.cache/genbasedir/"
-    assert(hlen + strLen(SUBDIR) + strLen(ENV) < PATH_MAX);
-    char path[hlen + strLen(SUBDIR) + strLen(ENV) + 1];
+    assert(hlen + strLen(SUBDIR) + nlen < PATH_MAX);
     memcpy(path, home, hlen);
     memcpy(path + hlen, SUBDIR, strLen(SUBDIR));
-    memcpy(path + hlen + strLen(SUBDIR), ENV, strLen(ENV) + 1);
+    memcpy(path + hlen + strLen(SUBDIR), name, nlen + 1);
     // mkdir -p ~/.cache/genbasedir
     char *slash1 = path + hlen + strLen(SUBDIR) - 1;
     assert(*slash1 == '/'), *slash1 = '\0';
@@ -346,6 +443,35 @@ static void md5cache_init(void)
 	    die("%s: %m", path);
     }
     *slash1 = '/';
+}
+
+// With --jobs, md5cache is called from worker threads.  The cache is
+// guarded by the mutex, which is released while md5 is being computed
+// the hard way.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef MD5CACHE_MD5DB
+#include <mdbx.h>
+
+static MDBX_env *env;
+// The read-only transaction for fast retrieval.
+static MDBX_txn *rtxn;
+// The environment is opened with MDBX_NOTLS, so that rtxn can be renewed
+// by any thread holding the mutex.
+#ifdef MD5CACHE_SRC
+// The unnamed database for gensrclist.
+static MDBX_dbi src_dbi;
+#endif
+
+// The current time slot for the atime, see md5cache_match.
+static unsigned short now;
+
+// Prepare a NOSUBDIR environment under ~/.cache/genbasedir/.
+static void md5cache_init(void)
+{
+    now = time(NULL) >> 16;
+    char path[PATH_MAX];
+    md5cache_path(path, ENV);
     // Create the environment.
     int rc = mdbx_env_create(&env);
     assert(rc == 0);
@@ -355,7 +481,7 @@ static void md5cache_init(void)
     // .$arch.rpm suffixes as part of rpm filenames.
     rc = mdbx_env_set_maxdbs(env, 8), assert(rc == 0);
 #endif
-    rc = mdbx_env_open(env, path, MDBX_NOSUBDIR, 0666);
+    rc = mdbx_env_open(env, path, MDBX_NOSUBDIR | MDBX_NOTLS, 0666);
     if (rc)
 	die("%s: %s", path, mdbx_strerror(rc));
     // Create the read transaction.
@@ -366,27 +492,104 @@ static void md5cache_init(void)
 #endif
 }
 
-static inline void md5hex(unsigned char bin[16], char str[33])
+// The optional inode index maps (st_dev, st_ino, size, mtime) to the same
+// "v" records.  Unlike the main environments, it is shared by gensrclist
+// and genpkglist, and by all the repos, so that a package which has already
+// been hashed under any name, e.g. hardlinked into another branch, costs
+// no reads.  (ctime is not part of the key, because creating a hardlink
+// changes ctime.)
+static MDBX_env *ienv;
+static MDBX_txn *irtxn;
+static MDBX_dbi idbi;
+
+static void md5cache_iinit(void)
+{
+    char path[PATH_MAX];
+    md5cache_path(path, "md5-ino");
+    int rc = mdbx_env_create(&ienv);
+    assert(rc == 0);
+    rc = mdbx_env_open(ienv, path, MDBX_NOSUBDIR | MDBX_NOTLS, 0666);
+    if (rc)
+	die("%s: %s", path, mdbx_strerror(rc));
+    rc = mdbx_txn_begin(ienv, NULL, MDBX_RDONLY, &irtxn), assert(rc == 0);
+    rc = mdbx_dbi_open(irtxn, NULL, 0, &idbi), assert(rc == 0);
+}
+#endif
+
+static inline void binhex(const unsigned char *bin, size_t n, char *str)
 {
     static const char hex[] = "0123456789abcdef";
-    for (int i = 0; i < 16; i++)
+    for (size_t i = 0; i < n; i++)
 	*str++ = hex[*bin >> 4],
 	*str++ = hex[*bin++ & 0xf];
     *str = '\0';
 }
 
+#define md5hex(bin, str) binhex(bin, 16, str)
+#define sha256hex(bin, str) binhex(bin, 32, str)
+
 #include <unistd.h>
+#include <fcntl.h>
 #include <openssl/md5.h>
+#include <openssl/sha.h>
+#include "md5cache.h"
+
+int md5cache_odirect;
+int md5cache_inode;
 
-static inline void md5fd(const char *rpm, int fd, unsigned char bin[16])
+// Files are read in large chunks, which saves a lot of syscalls
+// on multi-gigabyte debuginfo packages.  The buffer is aligned for O_DIRECT.
+#define MD5FD_BUFSIZE (1<<20)
+#define MD5FD_ALIGN 4096
+
+// Behind the read cursor, the pages are dropped from the page cache, so that
+// hashing a big repo does not evict everything else.  The first 64K, which
+// are likely to hold the header, are kept though, because md5cache_prewarm
+// runs before the headers are read.
+#define MD5FD_KEEP (64<<10)
+
+struct digests {
+    MD5_CTX md5;
+    SHA256_CTX sha;
+    bool wantSha;
+};
+
+static inline void digests_update(struct digests *d, const void *buf, size_t size)
+{
+    MD5_Update(&d->md5, buf, size);
+    if (d->wantSha)
+	SHA256_Update(&d->sha, buf, size);
+}
+
+// Both digests are computed in a single read, the data being still hot
+// in L1 when SHA256_Update gets to it.  With sha NULL, only md5 is computed.
+static void md5fd(const char *rpm, int fd, unsigned char bin[16], unsigned char sha[32])
 {
-    MD5_CTX c;
-    MD5_Init(&c);
-    if (lseek(fd, 0, 0) < 0)
-	die("%s: %m", "lseek");
+    struct digests d;
+    MD5_Init(&d.md5);
+    d.wantSha = sha;
+    if (sha)
+	SHA256_Init(&d.sha);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+	die("%s: %m", rpm);
+    // With O_DIRECT, the file is reopened.  Some filesystems (e.g. tmpfs)
+    // do not support O_DIRECT, in which case the page cache is used after all.
+    int dfd = md5cache_odirect ? open(rpm, O_RDONLY | O_DIRECT) : -1;
+    int rfd = dfd < 0 ? fd : dfd;
+    off_t pos = 0;
+    if (dfd < 0)
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Small files do not need the full-size buffer.
+    size_t bufSize = MD5FD_BUFSIZE;
+    if (st.st_size < (off_t) bufSize)
+	bufSize = (st.st_size + MD5FD_ALIGN) & ~(size_t) (MD5FD_ALIGN - 1);
+    unsigned char *buf = aligned_alloc(MD5FD_ALIGN, bufSize);
+    if (!buf)
+	die("cannot allocate %zu bytes", bufSize);
+    off_t dropped = MD5FD_KEEP;
     while (1) {
-	char buf[BUFSIZ];
-	ssize_t ret = read(fd, buf, sizeof buf);
+	ssize_t ret = pread(rfd, buf, bufSize, pos);
 	if (ret < 0) {
 	    if (errno == EINTR)
 		continue;
@@ -394,19 +597,53 @@ static inline void md5fd(const char *rpm, int fd, unsigned char bin[16])
 	}
 	if (ret == 0)
 	    break;
-	MD5_Update(&c, buf, ret);
+	pos += ret;
+	digests_update(&d, buf, ret);
+	if (dfd < 0 && pos > dropped) {
+	    posix_fadvise(fd, dropped, pos - dropped, POSIX_FADV_DONTNEED);
+	    dropped = pos;
+	}
+	// O_DIRECT cannot continue at an unaligned offset, which is only
+	// possible at EOF anyway.
+	if (dfd >= 0 && (pos & (MD5FD_ALIGN - 1)))
+	    break;
     }
-    MD5_Final(bin, &c);
+    free(buf);
+    if (dfd >= 0)
+	close(dfd);
+    else
+	posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+    MD5_Final(bin, &d.md5);
+    if (sha)
+	SHA256_Final(sha, &d.sha);
 }
 
 #include <endian.h>
-#include "md5cache.h"
+#include <time.h>
+
+// The key, prepared from the rpm filename.
+struct md5key {
+#ifdef MD5CACHE_MD5DB
+    size_t len;
+#else
+    MDBX_val k;
+#ifndef MD5CACHE_SRC
+    const char *arch;
+#endif
+    // Set by the lookup, for a later put.
+    MDBX_dbi dbi;
+    // The key into the inode index.
+    struct { unsigned long long dev, ino; unsigned sm[2]; } ino;
+#endif
+    // The key points into the copy.
+    char copy[NAME_MAX+1];
+};
 
-void md5cache(const char *rpm, struct stat *st, int fd, char md5[33])
+static void md5cache_key(const char *rpm, struct md5key *key)
 {
     // Going to prepare the key without the .xxx.rpm suffix.
     size_t len = strlen(rpm);
-    if (len < minRpmLen)
+    if (len < minRpmLen || len > NAME_MAX)
 	die("%s: bad rpm name", rpm);
 #ifdef MD5CACHE_SRC
     // Assume it ends with .src.rpm, that's what readdir should check.
@@ -415,69 +652,1299 @@ void md5cache(const char *rpm, struct stat *st, int fd, char md5[33])
     // Assume it ends with .rpm but not with .src.rpm.
     len -= 4;
 #endif
-    char copy[len+1];
+    char *copy = key->copy;
     memcpy(copy, rpm, len);
     copy[len] = '\0';
-#ifdef MD5CACHE_SRC
-    MDBX_val k = { copy, len };
+#if defined(MD5CACHE_MD5DB)
+    key->len = len;
+#elif defined(MD5CACHE_SRC)
+    key->k = (MDBX_val) { copy, len };
 #else
     // Deduce the arch and use it as the database name.
-    char *kk; size_t klen; const char *arch;
-    if (!split_ka(copy, len, &kk, &klen, &arch) || klen < minKeyLen)
+    char *kk; size_t klen;
+    if (!split_ka(copy, len, &kk, &klen, &key->arch) || klen < minKeyLen)
 	die("%s: bad rpm name", rpm);
-    MDBX_val k = { kk, klen };
+    key->k = (MDBX_val) { kk, klen };
 #endif
-    // Initialize or renew the read transaction.
-    int rc;
+}
+
+// The "v" record: size+mtime and md5, optionally followed by sha256.
+// The records written before sha256 was supported are simply shorter,
+// and are still good for md5.
+struct smb {
+    unsigned sm[2];
+    unsigned char bin[16];
+    unsigned char sha[32];
+};
+
+#define SMB_MD5LEN offsetof(struct smb, sha)
+static_assert(sizeof(struct smb) == SMB_MD5LEN + 32, "no padding");
+
+static inline void md5cache_sm(const struct stat *st, struct md5key *key, unsigned sm[2])
+{
+    sm[0] = htole32(st->st_size);
+    sm[1] = htole32(st->st_mtime);
+#ifndef MD5CACHE_MD5DB
+    key->ino.dev = st->st_dev;
+    key->ino.ino = st->st_ino;
+    memcpy(key->ino.sm, sm, sizeof key->ino.sm);
+#endif
+}
+
+#ifdef MD5CACHE_MD5DB
+#include <sys/file.h>
+
+static struct md5db db;
+static bool loaded, dirty;
+// The identity of the database file as loaded, to tell whether it has been
+// rewritten by another process since.
+static struct stat ident;
+
+static inline bool sameFile(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	   a->st_size == b->st_size &&
+	   a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	   a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// The entries only have 6 bytes for size+mtime, which is a hash then.
+// A collision would require the same N-V-R to be rebuilt with a different
+// md5, while size+mtime hash to the same value.
+static inline void md5db_sm(const struct smb *v, unsigned short sm[3])
+{
+    unsigned long long x = le32toh(v->sm[0]);
+    x = (x << 32 | le32toh(v->sm[1])) * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 3; i++)
+	sm[i] = htole16(x >> (16 + 16 * i));
+}
+
+static void md5db_load(void)
+{
+    now = time(NULL) >> 16;
+    char path[PATH_MAX];
+    md5cache_path(path, ENV ".zst");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	if (errno != ENOENT)
+	    die("%s: %m", path);
+	return;
+    }
+    if (fstat(fd, &ident) < 0)
+	die("%s: %m", path);
+    const char *err[2];
+    if (!md5db_readall(&db, fd, err))
+	die("%s: %s: %s", path, err[0], err[1]);
+    close(fd);
+}
+
+// Zstd compression level.  The md5 sums are incompressible anyway.
+#define ZLEVEL 6
+
+// Write the database back.  The writers are serialized with flock on
+// a separate lock file, and the database is replaced with rename, so
+// the readers need no locking.  If the database has been rewritten by
+// another process since it was loaded, the other version is merged in.
+static void md5db_save(void)
+{
+    md5db_asort(&db);
+    char path[PATH_MAX], tmp[PATH_MAX], lock[PATH_MAX];
+    md5cache_path(path, ENV ".zst");
+    md5cache_path(tmp, ENV ".zst.tmp");
+    md5cache_path(lock, ENV ".lock");
+    int lockfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (lockfd < 0)
+	die("%s: %m", lock);
+    if (flock(lockfd, LOCK_EX) < 0)
+	die("%s: %m", lock);
+    const char *err[2];
+    char fdabuf[NREADA];
+    struct fda fda = { -1, fdabuf };
+    struct zstdreader *z0 = NULL;
+    fda.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fda.fd < 0 && errno != ENOENT)
+	die("%s: %m", path);
+    if (fda.fd >= 0) {
+	struct stat st;
+	if (fstat(fda.fd, &st) < 0)
+	    die("%s: %m", path);
+	if (!sameFile(&st, &ident) && zstdreader_open(&z0, &fda, err) < 0)
+	    die("%s: %s: %s", path, err[0], err[1]);
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+	die("%s: %m", tmp);
+    struct zstdwriter *z;
+    if (!zstdwriter_open(&z, fd, ZLEVEL, err))
+	die("%s: %s: %s", tmp, err[0], err[1]);
+    if (!md5db_writeloop(&db, z0, z, err))
+	die("%s: %s: %s", path, err[0], err[1]);
+    if (!zstdwriter_close(z, err))
+	die("%s: %s: %s", tmp, err[0], err[1]);
+    if (fsync(fd) < 0)
+	die("%s: %m", tmp);
+    // Once the other version is merged in, the new file has the entries
+    // which are not in memory, so the file must be merged next time, too.
+    if (!z0 && fstat(fd, &ident) < 0)
+	die("%s: %m", tmp);
+    if (close(fd) < 0)
+	die("%s: %m", tmp);
+    if (rename(tmp, path) < 0)
+	die("%s: %m", path);
+    if (z0) {
+	zstdreader_free(z0);
+	memset(&ident, 0, sizeof ident);
+    }
+    if (fda.fd >= 0)
+	close(fda.fd);
+    // Releases the lock.
+    close(lockfd);
+}
+
+static const unsigned char zero32[32];
+
+// Look up the key, returns true on hit, in which case v->bin is filled
+// (and v->sha, if requested; a record without sha256 is then a miss).
+// Must be called under the mutex.
+static bool md5cache_get(struct md5key *key, struct smb *v, bool sha)
+{
+    if (!loaded)
+	md5db_load(), loaded = true;
+    struct entv *e = md5db_find(&db, key->copy);
+    if (!e)
+	return false;
+    unsigned short sm[3];
+    md5db_sm(v, sm);
+    if (memcmp(e->sm, sm, sizeof sm))
+	return false;
+    if (sha && memcmp(e->sha256, zero32, 32) == 0)
+	return false;
+    memcpy(v->bin, e->md5, 16);
+    memcpy(v->sha, e->sha256, 32);
+    // Mark the entry as fresh, see md5db_write1.  The database only
+    // needs to be written if the atime actually changes.
+    if (e->atime != now && e->atime != now + 1)
+	dirty = true;
+    e->atime = now + 1;
+    return true;
+}
+
+// Whether there is a record under the name, whatever its size+mtime.
+// Must be called under the mutex.
+static bool md5cache_has(struct md5key *key)
+{
+    if (!loaded)
+	md5db_load(), loaded = true;
+    return md5db_find(&db, key->copy);
+}
+
+static void md5cache_getmany(size_t n, struct md5key *keys, struct smb *vv, bool sha,
+			     bool hit[])
+{
+    for (size_t i = 0; i < n; i++)
+	hit[i] = md5cache_get(&keys[i], &vv[i], sha);
+}
+
+// Add or replace the entry, with sha256 if sha is set.  Must be called
+// under the mutex, after md5cache_get or md5cache_has.
+static void md5cache_put(const struct md5key *key, const struct smb *v, bool sha)
+{
+    assert(loaded);
+    struct entv *e = md5db_find(&db, key->copy);
+    bool added = !e;
+    if (added) {
+	if (db.aend == NENT)
+	    die("%s: too many entries", ENV);
+	unsigned six = addStr(key->copy, key->len);
+	if (six == -1)
+	    die("%s: too many keys", ENV);
+	db.kk[db.aend] = six;
+	e = &db.ee[db.aend++];
+    }
+    md5db_sm(v, e->sm);
+    e->atime = now + 1;
+    memcpy(e->md5, v->bin, 16);
+    memcpy(e->sha256, sha ? v->sha : zero32, 32);
+    dirty = true;
+    if (added && db.aend - db.send >= MAXUNSORTED)
+	md5db_asort(&db);
+}
+
+// Must be called under the mutex.
+static void md5cache_commit(void)
+{
+    if (dirty)
+	md5db_save(), dirty = false;
+}
+
+// There is no inode index, and no vtime.
+#define md5cache_put1(key, v, sha, ino) md5cache_put(key, v, sha)
+
+// OLD records are dropped by md5db_save.
+static inline void md5cache_gc(void) { }
+
+// The file is rewritten by each md5db_save anyway.
+void md5cache_compact(void) { }
+
+// There is no vtime to rotate on, either.
+void md5cache_scrub_start(size_t n, const char *const rpms[], double mbps)
+{
+    (void) n, (void) rpms, (void) mbps;
+    warn("scrubbing is not supported by md5db");
+}
+
+void md5cache_scrub_stop(void) { }
+
+// The size+mtime is only kept as a hash, so the records cannot be exported
+// (the file can be copied, though).
+void md5cache_export(const char *to)
+{
+    char path[PATH_MAX];
+    md5cache_path(path, ENV ".zst");
+    die("%s: cannot export md5db, copy %s instead", to, path);
+}
+#else
+// Initialize or renew the read transaction.  Must be called under the mutex.
+static void md5cache_rbegin(void)
+{
     if (!env)
 	md5cache_init(), assert(env);
-    else
-	rc = mdbx_txn_renew(rtxn), assert(rc == 0);
+    else {
+	int rc = mdbx_txn_renew(rtxn);
+	assert(rc == 0);
+    }
+}
+
+#ifndef MD5CACHE_SRC
+// There can be special binary repos, such as distro's RPMS.main, which
+// are combined of a few repo components (e.g. x86_64, noarch, and
+// i586-arepo).  In other words, we may need to open a few per-arch
+// sub-databases within a single run.  They are opened once rather than
+// on each lookup.
+#define MAXSUBDB 4
+static struct { char arch[32]; MDBX_dbi dbi; } subdb[MAXSUBDB];
+static int nsubdb;
+#endif
+
+// The dbi for the key.  Must be called under the mutex, with rtxn renewed.
+static MDBX_dbi md5cache_dbi(struct md5key *key)
+{
 #ifdef MD5CACHE_SRC
-    MDBX_dbi dbi = src_dbi;
+    return src_dbi;
 #else
+    for (int i = 0; i < nsubdb; i++)
+	if (strcmp(subdb[i].arch, key->arch) == 0)
+	    return subdb[i].dbi;
     MDBX_dbi dbi;
-    rc = mdbx_dbi_open(rtxn, arch, 0, &dbi), assert(rc == 0);
+    int rc = mdbx_dbi_open(rtxn, key->arch, 0, &dbi);
+    assert(rc == 0);
+    // Unusual arches beyond MAXSUBDB are not cached, which is still correct.
+    size_t len = strlen(key->arch);
+    if (nsubdb < MAXSUBDB && len < sizeof subdb->arch) {
+	memcpy(subdb[nsubdb].arch, key->arch, len + 1);
+	subdb[nsubdb++].dbi = dbi;
+    }
+    return dbi;
 #endif
-    // Ready to get.
-    MDBX_val v;
-    rc = mdbx_get(rtxn, dbi, &k, &v);
-    // Retire the read transaction asap.
-    mdbx_txn_reset(rtxn);
+}
+
+// The record is followed by the tail: the atime, unix time >> 16 (which
+// is about 18 hours), and the vtime, when the digests were last verified
+// by reading the file (0 if they were imported or seeded), 2 bytes each,
+// little-endian.  The records written before the atime was introduced
+// don't have the tail, and those written before the vtime have only
+// the atime.
+struct tail { unsigned short atime, vtime; };
+#define TAIL_LEN 4
+#define OLD(atime) (atime + 20 < now)
+
+// The length of the record without the tail, or 0 if the value is bad.
+// The missing parts of the tail are zeroed.
+static inline size_t md5cache_vlen(const MDBX_val *val, struct tail *t)
+{
+    unsigned short tt[2] = { 0, 0 };
+    for (size_t tlen = 0; tlen <= TAIL_LEN; tlen += 2) {
+	size_t len = val->iov_len - tlen;
+	if (val->iov_len < tlen || (len != SMB_MD5LEN && len != sizeof(struct smb)))
+	    continue;
+	memcpy(tt, (char *) val->iov_base + len, tlen);
+	t->atime = le16toh(tt[0]);
+	t->vtime = le16toh(tt[1]);
+	return len;
+    }
+    return 0;
+}
+
+// Append the tail to the record of the given length.
+static inline size_t md5cache_addtail(unsigned char *v, size_t len, unsigned short vtime)
+{
+    unsigned short tt[2] = { htole16(now), htole16(vtime) };
+    memcpy(v + len, tt, TAIL_LEN);
+    return len + TAIL_LEN;
+}
+
+// Check the record found by the key.  Returns the length of the record
+// on hit (i.e. whether it has sha256), in which case v->bin is filled
+// (and v->sha, if requested; a record without sha256 is then a miss).
+// Returns 0 on miss.  On hit, the tail is filled; if the atime is not
+// current, the record is to be rewritten (see md5cache_touch).  The atime
+// thus costs at most one write per record per time slot, and goes with
+// the group commit.
+static size_t md5cache_match(int rc, const MDBX_val *val, struct smb *v, bool sha, struct tail *t)
+{
+    if (rc == MDBX_NOTFOUND)
+	return 0;
+    if (rc)
+	die("%s: %s", "mdbx_get", mdbx_strerror(rc));
+    // Had better get size+mtime and md5, and possibly sha256.
+    size_t len = md5cache_vlen(val, t);
+    assert(len);
     // Check that the file size and mtime are the same.
     // Otherwise, the record will be replaced.
-    unsigned sm[2] = { htole32(st->st_size), htole32(st->st_mtime) };
-    if (rc == 0) {
-	// Had better get size+mtime and md5.
-	assert(v.iov_len == sizeof sm + 16);
-	// Verify size+mtime.
-	if (memcmp(sm, v.iov_base, sizeof sm) == 0) {
-	    md5hex((unsigned char *) v.iov_base + sizeof sm, md5);
-	    return;
+    if (memcmp(v->sm, val->iov_base, sizeof v->sm))
+	return 0;
+    if (sha && len != sizeof *v)
+	return 0;
+    memcpy(v->bin, (char *) val->iov_base + sizeof v->sm, len - sizeof v->sm);
+    return len;
+}
+
+// The new records are not committed one by one, each commit being
+// an fsync.  Instead, they are gathered here and committed as a group,
+// once there are GROUP_MAX of them, or once the oldest one has been
+// waiting for GROUP_SECS, and finally by md5cache_flush.  A crash thus
+// loses at most the last group, which is then simply recomputed on the
+// next run: the database itself stays consistent, since each group is
+// a single transaction.
+//
+// There are usually many genbasedir processes running at once, one per
+// component and arch, and they all contend for the same writer lock.
+// So a group is only committed if the lock can be taken right away;
+// otherwise, the records stay pending, and the commit is retried with
+// the next record.  Only when the backlog grows to PENDING_MAX, and on
+// md5cache_flush, does the process block on the lock.  (Readers never
+// take the lock, so lookups are not affected either way.)
+#define GROUP_MAX 4096
+#define GROUP_SECS 30
+#define PENDING_MAX (4 * GROUP_MAX)
+
+static struct pending {
+    struct md5key key;
+    unsigned vlen;
+    // Also goes to the inode index.
+    bool ino;
+    // The record, followed by the tail.
+    unsigned char v[sizeof(struct smb) + TAIL_LEN];
+} pending[PENDING_MAX];
+static size_t npending;
+static time_t pendingSince;
+
+// Store the pending records in a single write transaction.  It is not
+// entirely clear whether dbi can be reused this way, but it seems to work.
+// With MDBX_TXN_TRY, returns false if the writer lock is busy, the records
+// still pending.  Must be called under the mutex.
+static bool md5cache_commit1(unsigned flags)
+{
+    if (npending == 0)
+	return true;
+    MDBX_txn *wtxn;
+    int rc;
+    // The inode index is a separate environment, hence a separate
+    // transaction.  It goes first, and once committed, the records
+    // stay pending only for the names.
+    size_t nino = 0;
+    for (size_t i = 0; i < npending; i++)
+	nino += pending[i].ino;
+    if (nino) {
+	if (!ienv)
+	    md5cache_iinit();
+	rc = mdbx_txn_begin(ienv, NULL, flags, &wtxn);
+	if (rc == MDBX_BUSY && (flags & MDBX_TXN_TRY))
+	    return false;
+	assert(rc == 0);
+	for (size_t i = 0; i < npending; i++) {
+	    struct pending *p = &pending[i];
+	    if (!p->ino)
+		continue;
+	    MDBX_val k = { &p->key.ino, sizeof p->key.ino };
+	    MDBX_val v = { p->v, p->vlen };
+	    rc = mdbx_put(wtxn, idbi, &k, &v, 0), assert(rc == 0);
 	}
+	rc = mdbx_txn_commit(wtxn), assert(rc == 0);
+	for (size_t i = 0; i < npending; i++)
+	    pending[i].ino = false;
     }
-    else if (rc != MDBX_NOTFOUND)
+    rc = mdbx_txn_begin(env, NULL, flags, &wtxn);
+    if (rc == MDBX_BUSY && (flags & MDBX_TXN_TRY))
+	return false;
+    assert(rc == 0);
+    for (size_t i = 0; i < npending; i++) {
+	struct pending *p = &pending[i];
+	MDBX_val v = { p->v, p->vlen };
+	rc = mdbx_put(wtxn, p->key.dbi, &p->key.k, &v, 0), assert(rc == 0);
+    }
+    rc = mdbx_txn_commit(wtxn), assert(rc == 0);
+    npending = 0;
+    return true;
+}
+
+// Commit, waiting for the writer lock.
+static void md5cache_commit(void)
+{
+    md5cache_commit1(0);
+}
+
+static inline time_t monotime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Queue a new record, with sha256 if sha is set, and possibly for
+// the inode index, too.  Must be called under the mutex.
+static void md5cache_queue(const struct md5key *key, const struct smb *v, bool sha, bool ino,
+			   unsigned short vtime)
+{
+    struct pending *p = &pending[npending];
+    // The key points into its own copy, and must be rebased.  The arch
+    // is not needed any longer, since the dbi is known.
+    memcpy(p->key.copy, key->copy, sizeof key->copy);
+    p->key.k.iov_base = p->key.copy + ((const char *) key->k.iov_base - key->copy);
+    p->key.k.iov_len = key->k.iov_len;
+#ifndef MD5CACHE_SRC
+    p->key.arch = NULL;
+#endif
+    p->key.dbi = key->dbi;
+    p->key.ino = key->ino;
+    p->ino = ino;
+    size_t len = sha ? sizeof *v : SMB_MD5LEN;
+    memcpy(p->v, v, len);
+    p->vlen = md5cache_addtail(p->v, len, vtime);
+    if (npending++ == 0)
+	pendingSince = monotime();
+    if (npending == PENDING_MAX)
+	md5cache_commit();
+    else if (npending >= GROUP_MAX || monotime() - pendingSince >= GROUP_SECS)
+	md5cache_commit1(MDBX_TXN_TRY);
+}
+
+// The digests have just been computed.
+static inline void md5cache_put(const struct md5key *key, const struct smb *v, bool sha)
+{
+    md5cache_queue(key, v, sha, md5cache_inode, now);
+}
+
+// The digests come from elsewhere; ino is set if the stat info is real.
+static inline void md5cache_put1(const struct md5key *key, const struct smb *v, bool sha,
+				 bool ino)
+{
+    md5cache_queue(key, v, sha, ino && md5cache_inode, 0);
+}
+
+// Rewrite the record found by md5cache_match if the atime is not current,
+// and with ino, the inode record, too.
+static inline void md5cache_touch(const struct md5key *key, const struct smb *v, size_t len,
+				  const struct tail *t, bool ino)
+{
+    if (t->atime != now || ino)
+	md5cache_queue(key, v, len == sizeof *v, ino, t->vtime);
+}
+
+// With md5cache_inode, look up the misses in the inode index.  The hits
+// are then also recorded under the name.  For the name hits, istale[i]
+// tells if the inode record is missing or its atime is not current, and
+// it is then rewritten by md5cache_touch; otherwise, the inode records
+// of the packages which are always found by name would be collected
+// as garbage.  Must be called under the mutex.
+static void md5cache_igetmany(size_t n, struct md5key *keys, struct smb *vv, bool sha,
+			      bool hit[], bool istale[])
+{
+    memset(istale, 0, n * sizeof *istale);
+    if (!md5cache_inode)
+	return;
+    if (!ienv)
+	md5cache_iinit();
+    else {
+	int rc = mdbx_txn_renew(irtxn);
+	assert(rc == 0);
+    }
+    size_t *ilen = xmalloc(n * sizeof *ilen);
+    struct tail *it = xmalloc(n * sizeof *it);
+    for (size_t i = 0; i < n; i++) {
+	ilen[i] = 0;
+	MDBX_val k = { &keys[i].ino, sizeof keys[i].ino }, val;
+	int rc = mdbx_get(irtxn, idbi, &k, &val);
+	if (hit[i]) {
+	    // Only the tail is of interest, the digests are known.
+	    struct smb v;
+	    memcpy(v.sm, vv[i].sm, sizeof v.sm);
+	    struct tail t;
+	    istale[i] = !md5cache_match(rc, &val, &v, false, &t) || t.atime != now;
+	    continue;
+	}
+	ilen[i] = md5cache_match(rc, &val, &vv[i], sha, &it[i]);
+    }
+    // The read transaction must be retired before a commit.
+    mdbx_txn_reset(irtxn);
+    for (size_t i = 0; i < n; i++)
+	if (ilen[i]) {
+	    hit[i] = true;
+	    // The name record is written anyway, and the inode record
+	    // along with it if its atime is not current.
+	    md5cache_queue(&keys[i], &vv[i], ilen[i] == sizeof vv[i],
+			   it[i].atime != now, it[i].vtime);
+	}
+    free(ilen), free(it);
+}
+
+// Look up the key, returns true on hit, see md5cache_match.  Also sets
+// key->dbi, for a later put.  Must be called under the mutex.
+static bool md5cache_get(struct md5key *key, struct smb *v, bool sha)
+{
+    md5cache_rbegin();
+    key->dbi = md5cache_dbi(key);
+    MDBX_val val;
+    int rc = mdbx_get(rtxn, key->dbi, &key->k, &val);
+    struct tail t;
+    size_t len = md5cache_match(rc, &val, v, sha, &t);
+    // Retire the read transaction asap.
+    mdbx_txn_reset(rtxn);
+    bool hit = len, istale;
+    md5cache_igetmany(1, key, v, sha, &hit, &istale);
+    if (len)
+	md5cache_touch(key, v, len, &t, istale);
+    return hit;
+}
+
+// Whether there is a record under the name, whatever its size+mtime.
+// Also sets key->dbi.  Must be called under the mutex.
+static bool md5cache_has(struct md5key *key)
+{
+    md5cache_rbegin();
+    key->dbi = md5cache_dbi(key);
+    MDBX_val val;
+    int rc = mdbx_get(rtxn, key->dbi, &key->k, &val);
+    if (rc && rc != MDBX_NOTFOUND)
 	die("%s: %s", "mdbx_get", mdbx_strerror(rc));
-    // Combine the "v" record.
-    struct { unsigned sm[2]; unsigned char bin[16]; } smb;
-    memcpy(smb.sm, sm, sizeof sm);
-    // Calculate md5 the hard way.
-    md5fd(rpm, fd, smb.bin);
-    v.iov_base = &smb, v.iov_len = sizeof smb;
-    // Need to run the write transaction.  It is not entirely clear
-    // whether dbi can be reused this way, but it seems to work.
+    mdbx_txn_reset(rtxn);
+    return rc == 0;
+}
+
+#include "qsort.h"
+
+// Look up a batch of keys within the read transaction, which must have
+// been begun.  The keys are sorted by sub-database and then in the database
+// order, and each sub-database is walked with a cursor, so that the B-tree
+// pages are touched sequentially.  Fills rc[i] and val[i], which is valid
+// until the transaction is reset.  Returns the order, to be freed.
+static size_t *md5cache_cursorget(size_t n, struct md5key *keys, int rc[], MDBX_val val[])
+{
+    size_t *order = xmalloc(n * sizeof *order);
+    for (size_t i = 0; i < n; i++) {
+	keys[i].dbi = md5cache_dbi(&keys[i]);
+	order[i] = i;
+    }
+    // The default mdbx key comparison: memcmp, then shorter first.
+#undef LESS
+#undef SWAP
+#define KEY(i) keys[order[i]].k
+#define KEYCMP(i, j) memcmp(KEY(i).iov_base, KEY(j).iov_base, \
+	KEY(i).iov_len < KEY(j).iov_len ? KEY(i).iov_len : KEY(j).iov_len)
+#define DBI(i) keys[order[i]].dbi
+#define LESS(i, j) (DBI(i) != DBI(j) ? DBI(i) < DBI(j) : \
+	KEYCMP(i, j) ? KEYCMP(i, j) < 0 : KEY(i).iov_len < KEY(j).iov_len)
+    size_t o;
+#define SWAP(i, j) o = order[i], order[i] = order[j], order[j] = o
+    QSORT(n, LESS, SWAP);
+    MDBX_cursor *cur = NULL;
+    for (size_t k = 0; k < n; k++) {
+	size_t i = order[k];
+	if (k == 0 || keys[i].dbi != DBI(k-1)) {
+	    if (cur)
+		mdbx_cursor_close(cur);
+	    int rc = mdbx_cursor_open(rtxn, keys[i].dbi, &cur);
+	    assert(rc == 0);
+	}
+	MDBX_val key = keys[i].k;
+	rc[i] = mdbx_cursor_get(cur, &key, &val[i], MDBX_SET_KEY);
+    }
+    if (cur)
+	mdbx_cursor_close(cur);
+    return order;
+}
+
+// Look up a batch of keys within a single read transaction, see
+// md5cache_cursorget.  Must be called under the mutex.
+static void md5cache_getmany(size_t n, struct md5key *keys, struct smb *vv, bool sha,
+			     bool hit[])
+{
+    md5cache_rbegin();
+    int *rc = xmalloc(n * sizeof *rc);
+    MDBX_val *val = xmalloc(n * sizeof *val);
+    size_t *order = md5cache_cursorget(n, keys, rc, val);
+    size_t *len = xmalloc(n * sizeof *len);
+    struct tail *tt = xmalloc(n * sizeof *tt);
+    for (size_t i = 0; i < n; i++) {
+	len[i] = md5cache_match(rc[i], &val[i], &vv[i], sha, &tt[i]);
+	hit[i] = len[i];
+    }
+    mdbx_txn_reset(rtxn);
+    free(rc), free(val);
+    bool *istale = xmalloc(n * sizeof *istale);
+    md5cache_igetmany(n, keys, vv, sha, hit, istale);
+    // The atime goes in the same order.
+    for (size_t k = 0; k < n; k++) {
+	size_t i = order[k];
+	if (len[i])
+	    md5cache_touch(&keys[i], &vv[i], len[i], &tt[i], istale[i]);
+    }
+    free(order), free(len), free(tt), free(istale);
+}
+
+// Garbage collection is incremental: each run, GC_STEP more records are
+// scanned, starting where the last run left off (the key is saved in
+// the file by the given name), and the OLD records are deleted.  The records
+// without the atime get the current one.  The pass is skipped if another
+// process is writing.  Must be called under the mutex.
+#define GC_STEP 16384
+static void md5cache_gc1(MDBX_env *e, MDBX_dbi dbi, const char *name)
+{
+    char path[PATH_MAX];
+    md5cache_path(path, name);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+	warn("%s: %m", path);
+	return;
+    }
     MDBX_txn *wtxn;
-    rc = mdbx_txn_begin(env, NULL, 0, &wtxn), assert(rc == 0);
-    rc = mdbx_put(wtxn, dbi, &k, &v, 0), assert(rc == 0);
+    int rc = mdbx_txn_begin(e, NULL, MDBX_TXN_TRY, &wtxn);
+    if (rc == MDBX_BUSY) {
+	close(fd);
+	return;
+    }
+    assert(rc == 0);
+    char pos[NAME_MAX+1];
+    ssize_t plen = pread(fd, pos, sizeof pos, 0);
+    if (plen < 0 || plen == sizeof pos)
+	plen = 0;
+    MDBX_cursor *cur;
+    rc = mdbx_cursor_open(wtxn, dbi, &cur), assert(rc == 0);
+    MDBX_val key = { pos, plen }, val;
+    rc = plen ? mdbx_cursor_get(cur, &key, &val, MDBX_SET_RANGE) : MDBX_NOTFOUND;
+    bool wrapped = false;
+    for (size_t i = 0; i < GC_STEP; i++) {
+	if (rc == MDBX_NOTFOUND) {
+	    // Wrap around, once.
+	    if (wrapped)
+		break;
+	    wrapped = true;
+	    rc = mdbx_cursor_get(cur, &key, &val, MDBX_FIRST);
+	    if (rc == MDBX_NOTFOUND)
+		break;
+	}
+	if (rc)
+	    die("%s: %s", "mdbx_cursor_get", mdbx_strerror(rc));
+	struct tail t;
+	size_t len = md5cache_vlen(&val, &t);
+	bool hasAtime = len && len < val.iov_len;
+	if (len == 0 || (hasAtime && OLD(t.atime)))
+	    rc = mdbx_cursor_del(cur, 0), assert(rc == 0);
+	else if (!hasAtime) {
+	    unsigned char buf[sizeof(struct smb) + TAIL_LEN];
+	    memcpy(buf, val.iov_base, len);
+	    MDBX_val v = { buf, md5cache_addtail(buf, len, 0) };
+	    rc = mdbx_cursor_put(cur, &key, &v, MDBX_CURRENT), assert(rc == 0);
+	}
+	rc = mdbx_cursor_get(cur, &key, &val, MDBX_NEXT);
+    }
+    // Where the next run starts.
+    plen = 0;
+    if (rc == 0 && key.iov_len < sizeof pos)
+	memcpy(pos, key.iov_base, key.iov_len), plen = key.iov_len;
+    mdbx_cursor_close(cur);
     rc = mdbx_txn_commit(wtxn), assert(rc == 0);
-    md5hex(smb.bin, md5);
+    if (pwrite(fd, pos, plen, 0) != plen || ftruncate(fd, plen) < 0)
+	warn("%s: %m", path);
+    close(fd);
 }
 
-void md5nocache(const char *rpm, int fd, char md5[33])
+// Must be called under the mutex.
+static void md5cache_gc(void)
 {
-    unsigned char bin[16];
-    md5fd(rpm, fd, bin);
+    if (!env)
+	return;
+#ifdef MD5CACHE_SRC
+    md5cache_gc1(env, src_dbi, ENV ".gc");
+#else
+    for (int i = 0; i < nsubdb; i++) {
+	char name[NAME_MAX+1];
+	snprintf(name, sizeof name, "%s.%s.gc", ENV, subdb[i].arch);
+	md5cache_gc1(env, subdb[i].dbi, name);
+    }
+#endif
+    if (ienv)
+	md5cache_gc1(ienv, idbi, "md5-ino.gc");
+}
+
+// Write the records of a sub-database, the keys followed by the suffix.
+static void md5cache_export1(FILE *fp, MDBX_dbi dbi, const char *suffix)
+{
+    MDBX_cursor *cur;
+    int rc = mdbx_cursor_open(rtxn, dbi, &cur);
+    assert(rc == 0);
+    MDBX_val key, val;
+    rc = mdbx_cursor_get(cur, &key, &val, MDBX_FIRST);
+    for (; rc == 0; rc = mdbx_cursor_get(cur, &key, &val, MDBX_NEXT)) {
+	struct tail t;
+	size_t len = md5cache_vlen(&val, &t);
+	if (len == 0 || memchr(key.iov_base, '\t', key.iov_len) ||
+			memchr(key.iov_base, '\n', key.iov_len))
+	    continue;
+	struct smb v;
+	memcpy(&v, val.iov_base, len);
+	char md5[33], sha256[65];
+	md5hex(v.bin, md5);
+	fprintf(fp, "%.*s%s\t%u\t%u\t%s", (int) key.iov_len, (char *) key.iov_base,
+		suffix, le32toh(v.sm[0]), le32toh(v.sm[1]), md5);
+	if (len == sizeof v) {
+	    sha256hex(v.sha, sha256);
+	    fprintf(fp, "\t%s", sha256);
+	}
+	putc('\n', fp);
+    }
+    if (rc != MDBX_NOTFOUND)
+	die("%s: %s", "mdbx_cursor_get", mdbx_strerror(rc));
+    mdbx_cursor_close(cur);
+}
+
+void md5cache_export(const char *to)
+{
+    FILE *fp = fopen(to, "w");
+    if (!fp)
+	die("%s: %m", to);
+    pthread_mutex_lock(&mutex);
+    md5cache_rbegin();
+#ifdef MD5CACHE_SRC
+    md5cache_export1(fp, src_dbi, ".src.rpm");
+#else
+    // The main database lists the per-arch sub-databases.
+    MDBX_dbi main;
+    int rc = mdbx_dbi_open(rtxn, NULL, 0, &main);
+    assert(rc == 0);
+    MDBX_cursor *cur;
+    rc = mdbx_cursor_open(rtxn, main, &cur);
+    assert(rc == 0);
+    MDBX_val key, val;
+    rc = mdbx_cursor_get(cur, &key, &val, MDBX_FIRST);
+    for (; rc == 0; rc = mdbx_cursor_get(cur, &key, &val, MDBX_NEXT)) {
+	char arch[32], suffix[64];
+	if (key.iov_len >= sizeof arch)
+	    continue;
+	memcpy(arch, key.iov_base, key.iov_len);
+	arch[key.iov_len] = '\0';
+	MDBX_dbi dbi;
+	rc = mdbx_dbi_open(rtxn, arch, 0, &dbi);
+	assert(rc == 0);
+	snprintf(suffix, sizeof suffix, ".%s.rpm", arch);
+	md5cache_export1(fp, dbi, suffix);
+    }
+    if (rc != MDBX_NOTFOUND)
+	die("%s: %s", "mdbx_cursor_get", mdbx_strerror(rc));
+    mdbx_cursor_close(cur);
+#endif
+    mdbx_txn_reset(rtxn);
+    pthread_mutex_unlock(&mutex);
+    if (fflush(fp) || ferror(fp) || fclose(fp))
+	die("%s: %m", to);
+}
+
+// Rewrite the environment with mdbx_env_copy, which only copies the live
+// pages.  It is only done if no other process has it open.
+static void md5cache_compact1(const char *name)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    md5cache_path(path, name);
+    if (access(path, F_OK) < 0)
+	return;
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    MDBX_env *e;
+    int rc = mdbx_env_create(&e);
+    assert(rc == 0);
+    rc = mdbx_env_set_maxdbs(e, 8), assert(rc == 0);
+    rc = mdbx_env_open(e, path, MDBX_NOSUBDIR | MDBX_EXCLUSIVE, 0666);
+    if (rc) {
+	warn("%s: not compacted: %s", path, mdbx_strerror(rc));
+	mdbx_env_close(e);
+	return;
+    }
+    unlink(tmp);
+    rc = mdbx_env_copy(e, tmp, MDBX_CP_COMPACT);
+    if (rc)
+	die("%s: %s", tmp, mdbx_strerror(rc));
+    if (rename(tmp, path) < 0)
+	die("%s: %m", path);
+    mdbx_env_close(e);
+}
+
+void md5cache_compact(void)
+{
+    pthread_mutex_lock(&mutex);
+    assert(!env && !ienv);
+    md5cache_compact1(ENV);
+    if (md5cache_inode)
+	md5cache_compact1("md5-ino");
+    pthread_mutex_unlock(&mutex);
+}
+
+// Scrubbing: the cached digests of the rpms in the current directory
+// are verified by reading the files again, which catches bit rot and
+// in-place rewrites that preserve mtime.  This is done in a background
+// thread, at the idle I/O priority and within the bandwidth budget, and
+// the thread is stopped as soon as the generation is done, so that it never
+// holds anything up.  Each run, up to SCRUB_MAX records which have not been
+// verified for the longest time are picked, so the whole repo is gradually
+// rotated through.
+#define SCRUB_MAX 4096
+// The survey takes the mutex for this many lookups at a time.
+#define SCRUB_BATCH 256
+
+static struct {
+    pthread_t thr;
+    bool running;
+    // Set by md5cache_scrub_stop.
+    bool stop;
+    // Bytes per second.
+    double rate;
+    size_t n;
+    const char *const *rpms;
+} scrub;
+
+// Look up the record as is, without touching it.  Returns the length
+// of the record, or 0.  Must be called under the mutex.
+static size_t md5cache_peek(struct md5key *key, struct smb *v, struct tail *t)
+{
+    md5cache_rbegin();
+    key->dbi = md5cache_dbi(key);
+    MDBX_val val;
+    int rc = mdbx_get(rtxn, key->dbi, &key->k, &val);
+    if (rc && rc != MDBX_NOTFOUND)
+	die("%s: %s", "mdbx_get", mdbx_strerror(rc));
+    size_t len = rc ? 0 : md5cache_vlen(&val, t);
+    if (len)
+	memcpy(v, val.iov_base, len);
+    mdbx_txn_reset(rtxn);
+    return len;
+}
+
+// Peek a batch of records with md5cache_cursorget.  Fills len[i], the length
+// of the record or 0, and the tail.  Must be called under the mutex.
+static void md5cache_peekmany(size_t n, struct md5key *keys, size_t len[], struct tail tt[])
+{
+    md5cache_rbegin();
+    int *rc = xmalloc(n * sizeof *rc);
+    MDBX_val *val = xmalloc(n * sizeof *val);
+    size_t *order = md5cache_cursorget(n, keys, rc, val);
+    for (size_t i = 0; i < n; i++) {
+	if (rc[i] && rc[i] != MDBX_NOTFOUND)
+	    die("%s: %s", "mdbx_cursor_get", mdbx_strerror(rc[i]));
+	len[i] = rc[i] ? 0 : md5cache_vlen(&val[i], &tt[i]);
+    }
+    mdbx_txn_reset(rtxn);
+    free(rc), free(val), free(order);
+}
+
+static inline double monotimef(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hash the file within the budget, the total count of bytes being kept
+// along with the start time.  Returns false if stopped half-way.
+static bool scrub_hash(const char *rpm, int fd, unsigned char bin[16], unsigned char sha[32],
+		       unsigned long long *total, double start)
+{
+    struct digests d;
+    MD5_Init(&d.md5);
+    d.wantSha = sha;
+    if (sha)
+	SHA256_Init(&d.sha);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    unsigned char *buf = aligned_alloc(MD5FD_ALIGN, MD5FD_BUFSIZE);
+    if (!buf)
+	die("cannot allocate %zu bytes", (size_t) MD5FD_BUFSIZE);
+    off_t pos = 0, dropped = MD5FD_KEEP;
+    bool done = false;
+    while (!__atomic_load_n(&scrub.stop, __ATOMIC_RELAXED)) {
+	ssize_t ret = pread(fd, buf, MD5FD_BUFSIZE, pos);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    warn("%s: %m", rpm);
+	    break;
+	}
+	if (ret == 0) {
+	    done = true;
+	    break;
+	}
+	digests_update(&d, buf, ret);
+	pos += ret;
+	*total += ret;
+	// As with md5fd, the header stays in the page cache.
+	if (pos > dropped) {
+	    posix_fadvise(fd, dropped, pos - dropped, POSIX_FADV_DONTNEED);
+	    dropped = pos;
+	}
+	// Sleep off the excess, in short naps, so as to notice the stop.
+	double ahead;
+	while ((ahead = *total / scrub.rate - (monotimef() - start)) > 0 &&
+		!__atomic_load_n(&scrub.stop, __ATOMIC_RELAXED)) {
+	    if (ahead > 0.1)
+		ahead = 0.1;
+	    struct timespec ts = { 0, ahead * 1e9 };
+	    nanosleep(&ts, NULL);
+	}
+    }
+    free(buf);
+    MD5_Final(bin, &d.md5);
+    if (sha)
+	SHA256_Final(sha, &d.sha);
+    return done;
+}
+
+#include <sys/syscall.h>
+
+static void *scrub_thread(void *arg)
+{
+    (void) arg;
+    // IOPRIO_WHO_PROCESS with 0 is the calling thread; IOPRIO_CLASS_IDLE.
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+    // Find the vtime of each rpm, -1 if not cached.  The records are
+    // looked up in batches, so that the mutex is taken once per batch.
+    int *vt = xmalloc(scrub.n * sizeof *vt);
+    struct md5key *keys = xmalloc(SCRUB_BATCH * sizeof *keys);
+    size_t ncached = 0;
+    for (size_t lo = 0; lo < scrub.n; lo += SCRUB_BATCH) {
+	size_t m = scrub.n - lo < SCRUB_BATCH ? scrub.n - lo : SCRUB_BATCH;
+	size_t len[SCRUB_BATCH];
+	struct tail tt[SCRUB_BATCH];
+	for (size_t j = 0; j < m; j++)
+	    md5cache_key(scrub.rpms[lo+j], &keys[j]);
+	pthread_mutex_lock(&mutex);
+	md5cache_peekmany(m, keys, len, tt);
+	pthread_mutex_unlock(&mutex);
+	for (size_t j = 0; j < m; j++) {
+	    vt[lo+j] = len[j] ? tt[j].vtime : -1;
+	    ncached += len[j] > 0;
+	}
+	if (__atomic_load_n(&scrub.stop, __ATOMIC_RELAXED))
+	    goto out;
+    }
+    if (ncached == 0)
+	goto out;
+    // Pick up to SCRUB_MAX records with the oldest vtime, in this order.
+    size_t *order = xmalloc(ncached * sizeof *order);
+    size_t npick = 0;
+    for (size_t i = 0; i < scrub.n; i++)
+	if (vt[i] >= 0)
+	    order[npick++] = i;
+    size_t o;
+#undef LESS
+#undef SWAP
+#define LESS(i, j) vt[order[i]] < vt[order[j]]
+#define SWAP(i, j) o = order[i], order[i] = order[j], order[j] = o
+    QSORT(npick, LESS, SWAP);
+    if (npick > SCRUB_MAX)
+	npick = SCRUB_MAX;
+    unsigned long long total = 0;
+    double start = monotimef();
+    for (size_t k = 0; k < npick; k++) {
+	const char *rpm = scrub.rpms[order[k]];
+	int fd = open(rpm, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	    continue;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+	    close(fd);
+	    continue;
+	}
+	struct md5key key;
+	md5cache_key(rpm, &key);
+	struct smb v, w;
+	md5cache_sm(&st, &key, w.sm);
+	struct tail t;
+	pthread_mutex_lock(&mutex);
+	size_t len = md5cache_peek(&key, &v, &t);
+	pthread_mutex_unlock(&mutex);
+	// The file has changed, which is up to md5cache to handle.
+	if (len == 0 || memcmp(v.sm, w.sm, sizeof v.sm)) {
+	    close(fd);
+	    continue;
+	}
+	bool sha = len == sizeof v;
+	bool done = scrub_hash(rpm, fd, w.bin, sha ? w.sha : NULL, &total, start);
+	close(fd);
+	if (!done)
+	    break;
+	if (memcmp(v.bin, w.bin, sizeof v.bin) || (sha && memcmp(v.sha, w.sha, sizeof v.sha))) {
+	    char md5[33], md5w[33];
+	    md5hex(v.bin, md5), md5hex(w.bin, md5w);
+	    warn("%s: digest mismatch: cached md5 %s, file md5 %s", rpm, md5, md5w);
+	    continue;
+	}
+	pthread_mutex_lock(&mutex);
+	md5cache_queue(&key, &v, sha, false, now);
+	pthread_mutex_unlock(&mutex);
+    }
+    free(order);
+out:
+    free(vt), free(keys);
+    return NULL;
+}
+
+void md5cache_scrub_start(size_t n, const char *const rpms[], double mbps)
+{
+    assert(!scrub.running && mbps > 0);
+    scrub.rate = mbps * (1<<20);
+    scrub.n = n;
+    scrub.rpms = rpms;
+    scrub.stop = false;
+    int rc = pthread_create(&scrub.thr, NULL, scrub_thread, NULL);
+    if (rc)
+	die("%s: %s", "pthread_create", strerror(rc));
+    scrub.running = true;
+}
+
+void md5cache_scrub_stop(void)
+{
+    if (!scrub.running)
+	return;
+    __atomic_store_n(&scrub.stop, true, __ATOMIC_RELAXED);
+    pthread_join(scrub.thr, NULL);
+    scrub.running = false;
+}
+
+#endif
+
+void md5cache_flush(void)
+{
+    pthread_mutex_lock(&mutex);
+    md5cache_commit();
+    md5cache_gc();
+    pthread_mutex_unlock(&mutex);
+}
+
+// In case the program exits without md5cache_flush, e.g. on error.
+// If the mutex is held, though, the program is dying half-way through
+// a cache update, and the records are better lost.
+static __attribute__((destructor)) void md5cache_fini(void)
+{
+    if (pthread_mutex_trylock(&mutex) == 0) {
+	md5cache_commit();
+	pthread_mutex_unlock(&mutex);
+    }
+}
+
+void md5cache(const char *rpm, struct stat *st, int fd, char md5[33], char sha256[65])
+{
+    struct md5key key;
+    md5cache_key(rpm, &key);
+    struct smb v;
+    md5cache_sm(st, &key, v.sm);
+    bool sha = sha256;
+    pthread_mutex_lock(&mutex);
+    bool hit = md5cache_get(&key, &v, sha);
+    pthread_mutex_unlock(&mutex);
+    if (!hit) {
+	// Calculate the digests the hard way.
+	md5fd(rpm, fd, v.bin, sha ? v.sha : NULL);
+	pthread_mutex_lock(&mutex);
+	md5cache_put(&key, &v, sha);
+	pthread_mutex_unlock(&mutex);
+    }
+    md5hex(v.bin, md5);
+    if (sha)
+	sha256hex(v.sha, sha256);
+}
+
+#include "md5mb.h"
+
+void md5cache_prewarm(size_t n, const char *const rpms[], bool sha)
+{
+    struct md5key *keys = xmalloc(n * sizeof *keys);
+    struct smb *vv = xmalloc(n * sizeof *vv);
+    bool *hit = xmalloc(n * sizeof *hit);
+    // The misses are gathered into these arrays.
+    struct md5key **mkeys = xmalloc(n * sizeof *mkeys);
+    struct smb **mvv = xmalloc(n * sizeof *mvv);
+    const char **mrpms = xmalloc(n * sizeof *mrpms);
+    unsigned char (*bin)[16] = xmalloc(n * sizeof *bin);
+    for (size_t i = 0; i < n; i++) {
+	struct stat st;
+	if (stat(rpms[i], &st) < 0)
+	    die("%s: %m", rpms[i]);
+	md5cache_key(rpms[i], &keys[i]);
+	md5cache_sm(&st, &keys[i], vv[i].sm);
+    }
+    pthread_mutex_lock(&mutex);
+    md5cache_getmany(n, keys, vv, sha, hit);
+    pthread_mutex_unlock(&mutex);
+    size_t nmiss = 0;
+    for (size_t i = 0; i < n; i++) {
+	if (hit[i])
+	    continue;
+	mkeys[nmiss] = &keys[i], mvv[nmiss] = &vv[i];
+	mrpms[nmiss] = rpms[i];
+	nmiss++;
+    }
+    if (nmiss && sha) {
+	// There is no multi-buffer sha256, each file is read once
+	// for both digests instead.
+	for (size_t i = 0; i < nmiss; i++) {
+	    int fd = open(mrpms[i], O_RDONLY);
+	    if (fd < 0)
+		die("%s: %m", mrpms[i]);
+	    md5fd(mrpms[i], fd, mvv[i]->bin, mvv[i]->sha);
+	    close(fd);
+	}
+    }
+    else if (nmiss) {
+	md5mb(nmiss, mrpms, bin, md5cache_odirect);
+	for (size_t i = 0; i < nmiss; i++)
+	    memcpy(mvv[i]->bin, bin[i], 16);
+    }
+    if (nmiss) {
+	pthread_mutex_lock(&mutex);
+	for (size_t i = 0; i < nmiss; i++)
+	    md5cache_put(mkeys[i], mvv[i], sha);
+	pthread_mutex_unlock(&mutex);
+    }
+    free(keys), free(vv), free(hit);
+    free(mkeys), free(mvv), free(mrpms), free(bin);
+}
+
+size_t md5cache_lookup_many(size_t n, const char *const rpms[], const struct stat st[],
+			   char (*md5)[33], bool hit[])
+{
+    struct md5key *keys = xmalloc(n * sizeof *keys);
+    struct smb *vv = xmalloc(n * sizeof *vv);
+    for (size_t i = 0; i < n; i++) {
+	md5cache_key(rpms[i], &keys[i]);
+	md5cache_sm(&st[i], &keys[i], vv[i].sm);
+    }
+    pthread_mutex_lock(&mutex);
+    md5cache_getmany(n, keys, vv, false, hit);
+    pthread_mutex_unlock(&mutex);
+    size_t nhit = 0;
+    for (size_t i = 0; i < n; i++)
+	if (hit[i])
+	    md5hex(vv[i].bin, md5[i]), nhit++;
+    free(keys), free(vv);
+    return nhit;
+}
+
+void md5nocache(const char *rpm, int fd, char md5[33], char sha256[65])
+{
+    unsigned char bin[16], sha[32];
+    md5fd(rpm, fd, bin, sha256 ? sha : NULL);
     md5hex(bin, md5);
+    if (sha256)
+	sha256hex(sha, sha256);
+}
+
+static inline int hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    return -1;
+}
+
+// The reverse of binhex, the string must be exactly 2n hex digits.
+static bool hexbin(const char *str, unsigned char *bin, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+	int hi = hexval(str[2*i]);
+	int lo = hi < 0 ? -1 : hexval(str[2*i+1]);
+	if (lo < 0)
+	    return false;
+	bin[i] = hi << 4 | lo;
+    }
+    return str[2*n] == '\0';
+}
+
+// Unless the record is there, add it.  With import, the stat info is not
+// real, so ino is not recorded, and a record under the same name is kept
+// whatever its size+mtime.  Returns false if the digests are malformed.
+static bool md5cache_seed1(const char *rpm, const struct stat *st,
+			   const char *md5, const char *sha256, bool import)
+{
+    struct md5key key;
+    md5cache_key(rpm, &key);
+    struct smb v;
+    md5cache_sm(st, &key, v.sm);
+    bool sha = sha256;
+    struct smb w;
+    if (!hexbin(md5, w.bin, 16) || (sha && !hexbin(sha256, w.sha, 32)))
+	return false;
+    pthread_mutex_lock(&mutex);
+    if (import ? !md5cache_has(&key) : !md5cache_get(&key, &v, sha)) {
+	memcpy(v.bin, w.bin, sizeof v.bin);
+	if (sha)
+	    memcpy(v.sha, w.sha, sizeof v.sha);
+	md5cache_put1(&key, &v, sha, !import);
+    }
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+void md5cache_seed(const char *rpm, const struct stat *st,
+		   const char *md5, const char *sha256)
+{
+    if (!md5cache_seed1(rpm, st, md5, sha256, false))
+	warn("%s: bad digests, not seeded", rpm);
+}
+
+void md5cache_import(const char *from)
+{
+    FILE *fp = fopen(from, "r");
+    if (!fp)
+	die("%s: %m", from);
+    char *line = NULL;
+    size_t alloc = 0;
+    ssize_t len;
+    unsigned lineno = 0;
+    while ((len = getline(&line, &alloc, fp)) >= 0) {
+	lineno++;
+	char rpm[NAME_MAX+1], md5[33], sha256[65];
+	unsigned size, mtime;
+	int n = sscanf(line, "%255s %u %u %32s %64s", rpm, &size, &mtime, md5, sha256);
+	// Unless n >= 1, rpm is not even set.
+	if (n < 4)
+	    die("%s:%u: bad record", from, lineno);
+	// The cache for srpms and the cache for binary rpms are not to be mixed.
+	size_t rlen = strlen(rpm);
+	bool src = rlen > strLen(".src.rpm") &&
+		   memcmp(rpm + rlen - strLen(".src.rpm"), ".src.rpm", strLen(".src.rpm")) == 0;
+#ifdef MD5CACHE_SRC
+	bool mine = src;
+#else
+	bool mine = !src;
+#endif
+	if (!mine)
+	    die("%s:%u: bad record", from, lineno);
+	struct stat st = { .st_size = size, .st_mtime = mtime };
+	if (!md5cache_seed1(rpm, &st, md5, n == 5 ? sha256 : NULL, true))
+	    die("%s:%u: bad digests", from, lineno);
+    }
+    if (ferror(fp))
+	die("%s: %m", from);
+    fclose(fp);
+    free(line);
+    md5cache_flush();
 }
 
 // ex:set ts=8 sts=4 sw=4 noet:
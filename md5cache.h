@@ -18,8 +18,73 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <stdbool.h>
 #include <sys/stat.h>
 
-// Provides MD5 sums for *.rpm files.
-void md5cache(const char *rpm, struct stat *st, int fd, char md5[33]);
-void md5nocache(const char *rpm, int fd, char md5[33]);
+// Provides MD5 sums for *.rpm files.  With sha256 non-NULL, SHA-256 sums
+// are also provided, computed in the same read of the file.
+void md5cache(const char *rpm, struct stat *st, int fd, char md5[33], char sha256[65]);
+void md5nocache(const char *rpm, int fd, char md5[33], char sha256[65]);
+
+// On a cold cache, compute the missing MD5 sums for a batch of rpms ahead
+// of time, a few files at once (see md5mb.h).  After md5cache_flush, the
+// subsequent md5cache calls will then hit the cache.  Can be called by
+// a few threads concurrently, on different batches.
+// With sha, SHA-256 sums are also computed (but without md5mb's help).
+void md5cache_prewarm(size_t n, const char *const rpms[], bool sha);
+
+// Look up a batch of rpms, typically sorted by filename, along with their
+// stat info.  The batch is processed within a single read transaction, and
+// each per-arch sub-database is walked with a cursor.  On hit, md5[i] is
+// filled.  Returns the number of hits.
+size_t md5cache_lookup_many(size_t n, const char *const rpms[], const struct stat st[],
+			   char (*md5)[33], bool hit[]);
+
+// The new records are committed to the cache in groups, rather than one by
+// one, so that a cold run commits only a few dozen times.  This commits
+// the last group, and should be called once all the rpms are processed
+// (or before a lookup of the records just added).  Otherwise, the group is
+// committed at exit.  If the program crashes, the records that have not been
+// committed are lost (but the cache stays consistent).  Each flush also
+// runs a step of garbage collection: the records which have not been hit
+// for about 15 days are dropped.
+void md5cache_flush(void);
+
+// Add a record with the digests known from elsewhere, e.g. from the previous
+// output, for the file with the given stat info.  The digests are trusted,
+// and replace the record with a different size+mtime.  sha256 can be NULL.
+void md5cache_seed(const char *rpm, const struct stat *st,
+		   const char *md5, const char *sha256);
+
+// Write the cache as text, one record per line: rpm filename, size, mtime,
+// md5, and possibly sha256, separated by tabs.  Only with the mdbx backend.
+void md5cache_export(const char *to);
+
+// Load the records written by md5cache_export, e.g. on another host.
+// The records already in the cache are kept, whatever their size+mtime.
+void md5cache_import(const char *from);
+
+// Start re-verifying the cached digests of the rpms (in the current
+// directory) in the background, reading no more than mbps megabytes per
+// second, at the idle I/O priority.  Mismatches are reported with warn,
+// and the records are left as they are.  The rpms[] must stay valid
+// until md5cache_scrub_stop.  Only with the mdbx backend.
+void md5cache_scrub_start(size_t n, const char *const rpms[], double mbps);
+
+// Stop scrubbing, possibly half-way.  Call before the last md5cache_flush.
+void md5cache_scrub_stop(void);
+
+// Rewrite the cache compactly, unless it is in use by another process.
+// Must be called before any other md5cache calls.
+void md5cache_compact(void);
+
+// With this flag set, the files are hashed with O_DIRECT, bypassing the page
+// cache (where supported).  Otherwise, the page cache is still spared: the
+// pages are dropped as the hashing goes.
+extern int md5cache_odirect;
+
+// With this flag set, the cache is also looked up by the file's inode, size
+// and mtime, in an index shared by all the repos (and by both gensrclist and
+// genpkglist), so that hardlinked packages are only hashed once.  Only with
+// the mdbx backend.
+extern int md5cache_inode;
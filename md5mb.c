@@ -0,0 +1,296 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include "errexit.h"
+#include "md5mb.h"
+
+// The vector of lanes.  With GCC vector extensions, the same code compiles
+// to AVX2 or SSE2 instructions.
+typedef uint32_t v8u __attribute__((vector_size(4 * MD5MB_LANES)));
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    a += f(b, c, d) + x + t, \
+    a = a << s | a >> (32 - s), \
+    a += b
+
+// The state of all lanes.
+struct md5mb_state {
+    v8u a, b, c, d;
+};
+
+// Process one 64-byte block per lane.
+__attribute__((target_clones("avx2", "default")))
+static void md5mb_block(struct md5mb_state *st, const unsigned char *blk[MD5MB_LANES])
+{
+    v8u X[16];
+    for (int i = 0; i < 16; i++)
+	for (int l = 0; l < MD5MB_LANES; l++) {
+	    uint32_t w;
+	    memcpy(&w, blk[l] + 4 * i, 4);
+	    X[i][l] = le32toh(w);
+	}
+    v8u a = st->a, b = st->b, c = st->c, d = st->d;
+
+    STEP(F, a, b, c, d, X[ 0], 0xd76aa478,  7);
+    STEP(F, d, a, b, c, X[ 1], 0xe8c7b756, 12);
+    STEP(F, c, d, a, b, X[ 2], 0x242070db, 17);
+    STEP(F, b, c, d, a, X[ 3], 0xc1bdceee, 22);
+    STEP(F, a, b, c, d, X[ 4], 0xf57c0faf,  7);
+    STEP(F, d, a, b, c, X[ 5], 0x4787c62a, 12);
+    STEP(F, c, d, a, b, X[ 6], 0xa8304613, 17);
+    STEP(F, b, c, d, a, X[ 7], 0xfd469501, 22);
+    STEP(F, a, b, c, d, X[ 8], 0x698098d8,  7);
+    STEP(F, d, a, b, c, X[ 9], 0x8b44f7af, 12);
+    STEP(F, c, d, a, b, X[10], 0xffff5bb1, 17);
+    STEP(F, b, c, d, a, X[11], 0x895cd7be, 22);
+    STEP(F, a, b, c, d, X[12], 0x6b901122,  7);
+    STEP(F, d, a, b, c, X[13], 0xfd987193, 12);
+    STEP(F, c, d, a, b, X[14], 0xa679438e, 17);
+    STEP(F, b, c, d, a, X[15], 0x49b40821, 22);
+
+    STEP(G, a, b, c, d, X[ 1], 0xf61e2562,  5);
+    STEP(G, d, a, b, c, X[ 6], 0xc040b340,  9);
+    STEP(G, c, d, a, b, X[11], 0x265e5a51, 14);
+    STEP(G, b, c, d, a, X[ 0], 0xe9b6c7aa, 20);
+    STEP(G, a, b, c, d, X[ 5], 0xd62f105d,  5);
+    STEP(G, d, a, b, c, X[10], 0x02441453,  9);
+    STEP(G, c, d, a, b, X[15], 0xd8a1e681, 14);
+    STEP(G, b, c, d, a, X[ 4], 0xe7d3fbc8, 20);
+    STEP(G, a, b, c, d, X[ 9], 0x21e1cde6,  5);
+    STEP(G, d, a, b, c, X[14], 0xc33707d6,  9);
+    STEP(G, c, d, a, b, X[ 3], 0xf4d50d87, 14);
+    STEP(G, b, c, d, a, X[ 8], 0x455a14ed, 20);
+    STEP(G, a, b, c, d, X[13], 0xa9e3e905,  5);
+    STEP(G, d, a, b, c, X[ 2], 0xfcefa3f8,  9);
+    STEP(G, c, d, a, b, X[ 7], 0x676f02d9, 14);
+    STEP(G, b, c, d, a, X[12], 0x8d2a4c8a, 20);
+
+    STEP(H, a, b, c, d, X[ 5], 0xfffa3942,  4);
+    STEP(H, d, a, b, c, X[ 8], 0x8771f681, 11);
+    STEP(H, c, d, a, b, X[11], 0x6d9d6122, 16);
+    STEP(H, b, c, d, a, X[14], 0xfde5380c, 23);
+    STEP(H, a, b, c, d, X[ 1], 0xa4beea44,  4);
+    STEP(H, d, a, b, c, X[ 4], 0x4bdecfa9, 11);
+    STEP(H, c, d, a, b, X[ 7], 0xf6bb4b60, 16);
+    STEP(H, b, c, d, a, X[10], 0xbebfbc70, 23);
+    STEP(H, a, b, c, d, X[13], 0x289b7ec6,  4);
+    STEP(H, d, a, b, c, X[ 0], 0xeaa127fa, 11);
+    STEP(H, c, d, a, b, X[ 3], 0xd4ef3085, 16);
+    STEP(H, b, c, d, a, X[ 6], 0x04881d05, 23);
+    STEP(H, a, b, c, d, X[ 9], 0xd9d4d039,  4);
+    STEP(H, d, a, b, c, X[12], 0xe6db99e5, 11);
+    STEP(H, c, d, a, b, X[15], 0x1fa27cf8, 16);
+    STEP(H, b, c, d, a, X[ 2], 0xc4ac5665, 23);
+
+    STEP(I, a, b, c, d, X[ 0], 0xf4292244,  6);
+    STEP(I, d, a, b, c, X[ 7], 0x432aff97, 10);
+    STEP(I, c, d, a, b, X[14], 0xab9423a7, 15);
+    STEP(I, b, c, d, a, X[ 5], 0xfc93a039, 21);
+    STEP(I, a, b, c, d, X[12], 0x655b59c3,  6);
+    STEP(I, d, a, b, c, X[ 3], 0x8f0ccc92, 10);
+    STEP(I, c, d, a, b, X[10], 0xffeff47d, 15);
+    STEP(I, b, c, d, a, X[ 1], 0x85845dd1, 21);
+    STEP(I, a, b, c, d, X[ 8], 0x6fa87e4f,  6);
+    STEP(I, d, a, b, c, X[15], 0xfe2ce6e0, 10);
+    STEP(I, c, d, a, b, X[ 6], 0xa3014314, 15);
+    STEP(I, b, c, d, a, X[13], 0x4e0811a1, 21);
+    STEP(I, a, b, c, d, X[ 4], 0xf7537e82,  6);
+    STEP(I, d, a, b, c, X[11], 0xbd3af235, 10);
+    STEP(I, c, d, a, b, X[ 2], 0x2ad7d2bb, 15);
+    STEP(I, b, c, d, a, X[ 9], 0xeb86d391, 21);
+
+    st->a += a, st->b += b, st->c += c, st->d += d;
+}
+
+// Each lane is fed from its own file, with the same I/O policy as md5fd:
+// large aligned reads, optionally with O_DIRECT, and otherwise the pages
+// behind the read cursor are dropped, except for the first LANEKEEP bytes,
+// which hold the header, to be read right after prewarming.  There are
+// eight lanes, hence a smaller buffer than md5fd's.
+#define LANEBUF (256<<10)
+#define LANEALIGN 4096
+#define LANEKEEP (64<<10)
+
+struct lane {
+    // The index of the file, or -1 if the lane is idle.
+    ssize_t i;
+    int fd;
+    bool direct;
+    // Bytes hashed so far.
+    uint64_t total;
+    // Bytes read so far, and how far the pages have been dropped.
+    off_t off, dropped;
+    // The read buffer.
+    size_t pos, len;
+    bool eof;
+    // The final block or two, with the padding.
+    unsigned char tail[128];
+    unsigned ntail, tpos;
+    unsigned char *buf;
+};
+
+// Called when the buffer has been consumed.  Since LANEBUF is a multiple
+// of 64, a partial block can only be left at EOF.
+static void lane_fill(struct lane *ln, const char *name)
+{
+    if (!ln->eof) {
+	assert(ln->pos == ln->len);
+	ln->pos = ln->len = 0;
+	while (ln->len < LANEBUF) {
+	    ssize_t ret = read(ln->fd, ln->buf + ln->len, LANEBUF - ln->len);
+	    if (ret < 0) {
+		if (errno == EINTR)
+		    continue;
+		die("%s: %m", name);
+	    }
+	    ln->len += ret, ln->off += ret;
+	    // O_DIRECT cannot continue at an unaligned offset, which is only
+	    // possible at EOF anyway.
+	    if (ret == 0 || (ln->direct && (ln->len & (LANEALIGN - 1)))) {
+		ln->eof = true;
+		break;
+	    }
+	}
+	// The data is now in the buffer, the pages are no longer needed.
+	if (!ln->direct && ln->off > ln->dropped) {
+	    posix_fadvise(ln->fd, ln->dropped, ln->off - ln->dropped, POSIX_FADV_DONTNEED);
+	    ln->dropped = ln->off;
+	}
+	if (ln->len >= 64)
+	    return;
+    }
+    // Prepare the padding.
+    size_t r = ln->len - ln->pos;
+    assert(r < 64);
+    ln->total += r;
+    memcpy(ln->tail, ln->buf + ln->pos, r);
+    ln->tail[r] = 0x80;
+    ln->ntail = r < 56 ? 64 : 128;
+    memset(ln->tail + r + 1, 0, ln->ntail - r - 1);
+    uint64_t bits = htole64(ln->total * 8);
+    memcpy(ln->tail + ln->ntail - 8, &bits, 8);
+    ln->tpos = 0;
+    ln->pos = ln->len = 0;
+}
+
+// Get the next block for the lane, and tell if it's the last one.
+static const unsigned char *lane_next(struct lane *ln, const char *name, bool *last)
+{
+    if (!ln->ntail && ln->len - ln->pos < 64)
+	lane_fill(ln, name);
+    if (ln->ntail) {
+	const unsigned char *blk = ln->tail + ln->tpos;
+	ln->tpos += 64;
+	*last = ln->tpos == ln->ntail;
+	return blk;
+    }
+    const unsigned char *blk = ln->buf + ln->pos;
+    ln->pos += 64, ln->total += 64;
+    *last = false;
+    return blk;
+}
+
+static void lane_start(struct lane *ln, struct md5mb_state *st, int l,
+		       ssize_t i, const char *name, bool direct)
+{
+    ln->i = i;
+    // Some filesystems (e.g. tmpfs) do not support O_DIRECT.
+    ln->fd = direct ? open(name, O_RDONLY | O_DIRECT) : -1;
+    ln->direct = ln->fd >= 0;
+    if (!ln->direct)
+	ln->fd = open(name, O_RDONLY);
+    if (ln->fd < 0)
+	die("%s: %m", name);
+    if (!ln->direct)
+	posix_fadvise(ln->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ln->total = 0;
+    ln->off = 0, ln->dropped = LANEKEEP;
+    ln->pos = ln->len = 0;
+    ln->eof = false;
+    ln->ntail = 0;
+    st->a[l] = 0x67452301;
+    st->b[l] = 0xefcdab89;
+    st->c[l] = 0x98badcfe;
+    st->d[l] = 0x10325476;
+}
+
+void md5mb(size_t n, const char *const name[], unsigned char (*bin)[16], bool direct)
+{
+    struct lane *lanes = xmalloc(MD5MB_LANES * sizeof *lanes);
+    struct md5mb_state st = { 0 };
+    static const unsigned char zero[64];
+    size_t next = 0, active = 0;
+    for (int l = 0; l < MD5MB_LANES; l++) {
+	lanes[l].buf = aligned_alloc(LANEALIGN, LANEBUF);
+	if (!lanes[l].buf)
+	    die("cannot allocate %zu bytes", (size_t) LANEBUF);
+	if (next < n)
+	    lane_start(&lanes[l], &st, l, next, name[next], direct), next++, active++;
+	else
+	    lanes[l].i = -1;
+    }
+    while (active) {
+	const unsigned char *blk[MD5MB_LANES];
+	bool last[MD5MB_LANES];
+	for (int l = 0; l < MD5MB_LANES; l++) {
+	    struct lane *ln = &lanes[l];
+	    if (ln->i < 0)
+		blk[l] = zero, last[l] = false;
+	    else
+		blk[l] = lane_next(ln, name[ln->i], &last[l]);
+	}
+	md5mb_block(&st, blk);
+	// Retire the finished lanes, and start the next files.
+	for (int l = 0; l < MD5MB_LANES; l++) {
+	    if (!last[l])
+		continue;
+	    struct lane *ln = &lanes[l];
+	    uint32_t h[4] = {
+		htole32(st.a[l]), htole32(st.b[l]),
+		htole32(st.c[l]), htole32(st.d[l]),
+	    };
+	    memcpy(bin[ln->i], h, 16);
+	    if (!ln->direct)
+		posix_fadvise(ln->fd, 0, 0, POSIX_FADV_NORMAL);
+	    close(ln->fd);
+	    if (next < n)
+		lane_start(ln, &st, l, next, name[next], direct), next++;
+	    else
+		ln->i = -1, active--;
+	}
+    }
+    for (int l = 0; l < MD5MB_LANES; l++)
+	free(lanes[l].buf);
+    free(lanes);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,33 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Multi-buffer MD5.  MD5 is serial within a stream, but independent streams
+// can be hashed in lockstep, each lane of a SIMD register running its own
+// stream.  This is useful on a cold md5cache, when a lot of rpms need to be
+// hashed.  The result is identical to that of the plain MD5.
+#define MD5MB_LANES 8
+
+// Compute the md5 of the n files, MD5MB_LANES at a time.  Each file is
+// opened by name and read until EOF, with O_DIRECT if direct is set and
+// the filesystem supports it.  Dies on error.
+void md5mb(size_t n, const char *const name[], unsigned char (*bin)[16], bool direct);
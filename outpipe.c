@@ -0,0 +1,221 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <zpkglist.h>
+#include "errexit.h"
+#include "outpipe.h"
+
+// The queue is bounded both by the number of blobs and by their total size.
+// Headers without file lists average at about 2K, so that's about 8M worth
+// of srclist headers, while bloated pkglist headers will hit the size limit.
+#define QLEN 4096
+#define QMAXBYTES (64<<20)
+
+struct outpipe {
+    int fd;
+    // The pipe between the feeder and the compressor.
+    int pipefd[2];
+    pthread_t feeder, compressor;
+    pthread_mutex_t mutex;
+    // The feeder waits for more blobs; the producer waits for the room.
+    pthread_cond_t more, room;
+    // The ring buffer of queued blobs, indexed with head and tail mod QLEN.
+    size_t head, tail;
+    size_t qbytes;
+    struct { void *blob; size_t blobSize; bool own; } q[QLEN];
+    // Set by outpipe_close.
+    bool closing;
+    // Errors are first recorded by the threads and later reported by the
+    // caller, on behalf of the main thread.
+    int werrno;
+    const char *zerr[2];
+    bool zfailed;
+    char name[];
+};
+
+// Each header on the list is preceded by the header magic.
+static const unsigned char magic[8] = { 0x8e, 0xad, 0xe8, 0x01, 0, 0, 0, 0 };
+
+static bool xwritev(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt) {
+	ssize_t ret = writev(fd, iov, iovcnt);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	// Partial write, advance the vector.
+	while (iovcnt && (size_t) ret >= iov->iov_len)
+	    ret -= iov->iov_len, iov++, iovcnt--;
+	if (iovcnt)
+	    iov->iov_base = (char *) iov->iov_base + ret, iov->iov_len -= ret;
+    }
+    return true;
+}
+
+static void *feeder(void *arg)
+{
+    struct outpipe *o = arg;
+    pthread_mutex_lock(&o->mutex);
+    while (1) {
+	while (o->head == o->tail && !o->closing)
+	    pthread_cond_wait(&o->more, &o->mutex);
+	if (o->head == o->tail)
+	    break;
+	void *blob = o->q[o->head % QLEN].blob;
+	size_t blobSize = o->q[o->head % QLEN].blobSize;
+	bool own = o->q[o->head % QLEN].own;
+	pthread_mutex_unlock(&o->mutex);
+	// After a write error, the queue is still drained, so that
+	// the producer is never stuck.  (Only the feeder sets werrno,
+	// so it can peek at it without the lock.)
+	int werrno = 0;
+	if (!o->werrno) {
+	    struct iovec iov[2] = {
+		{ (void *) magic, sizeof magic },
+		{ blob, blobSize },
+	    };
+	    if (!xwritev(o->pipefd[1], iov, 2))
+		werrno = errno;
+	}
+	if (own)
+	    free(blob);
+	pthread_mutex_lock(&o->mutex);
+	if (werrno)
+	    o->werrno = werrno;
+	o->head++;
+	o->qbytes -= blobSize;
+	pthread_cond_signal(&o->room);
+    }
+    pthread_mutex_unlock(&o->mutex);
+    // Signal EOF to the compressor.
+    close(o->pipefd[1]);
+    return NULL;
+}
+
+static void *compressor(void *arg)
+{
+    struct outpipe *o = arg;
+    const char *err[2];
+    int rc = zpkglistCompress(o->pipefd[0], o->fd, err, NULL, NULL);
+    if (rc < 0) {
+	pthread_mutex_lock(&o->mutex);
+	o->zerr[0] = err[0], o->zerr[1] = err[1];
+	o->zfailed = true;
+	pthread_mutex_unlock(&o->mutex);
+    }
+    close(o->pipefd[0]);
+    return NULL;
+}
+
+// Report the error recorded by either thread.
+static void outpipe_die(struct outpipe *o)
+{
+    // The compressor's error takes precedence, since it would also
+    // cause EPIPE in the feeder.
+    if (o->zfailed) {
+	if (strcmp(o->zerr[0], "zpkglistCompress") == 0)
+	    die("%s: %s: %s", o->name, o->zerr[0], o->zerr[1]);
+	else
+	    die("%s: %s: %s: %s", o->name, "zpkglistCompress", o->zerr[0], o->zerr[1]);
+    }
+    assert(o->werrno);
+    errno = o->werrno;
+    die("%s: %m", o->name);
+}
+
+struct outpipe *outpipe_open(int fd, const char *name)
+{
+    size_t len = strlen(name);
+    struct outpipe *o = xmalloc(sizeof *o + len + 1);
+    memcpy(o->name, name, len + 1);
+    o->fd = fd;
+    if (pipe2(o->pipefd, O_CLOEXEC) < 0)
+	die("%s: %m", "pipe2");
+    // A larger pipe means fewer context switches; this may fail due to
+    // /proc/sys/fs/pipe-max-size, though, in which case never mind.
+    fcntl(o->pipefd[1], F_SETPIPE_SZ, 1<<20);
+    // If the compressor fails, the feeder gets EPIPE rather than SIGPIPE.
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&o->mutex, NULL);
+    pthread_cond_init(&o->more, NULL);
+    pthread_cond_init(&o->room, NULL);
+    o->head = o->tail = 0;
+    o->qbytes = 0;
+    o->closing = false;
+    o->werrno = 0;
+    o->zfailed = false;
+    int rc = pthread_create(&o->compressor, NULL, compressor, o);
+    if (rc)
+	die("%s: %s", "pthread_create", strerror(rc));
+    rc = pthread_create(&o->feeder, NULL, feeder, o);
+    if (rc)
+	die("%s: %s", "pthread_create", strerror(rc));
+    return o;
+}
+
+void outpipe_put(struct outpipe *o, void *blob, size_t blobSize, bool own)
+{
+    pthread_mutex_lock(&o->mutex);
+    // A huge blob can exceed QMAXBYTES on its own, which is okay
+    // as long as it's the only one in the queue.
+    while (o->tail - o->head == QLEN ||
+	   (o->qbytes && o->qbytes + blobSize > QMAXBYTES))
+	pthread_cond_wait(&o->room, &o->mutex);
+    // Fail early, rather than keep reading the headers in vain.
+    if (o->zfailed || o->werrno)
+	outpipe_die(o);
+    o->q[o->tail % QLEN].blob = blob;
+    o->q[o->tail % QLEN].blobSize = blobSize;
+    o->q[o->tail % QLEN].own = own;
+    o->tail++;
+    o->qbytes += blobSize;
+    pthread_cond_signal(&o->more);
+    pthread_mutex_unlock(&o->mutex);
+}
+
+void outpipe_close(struct outpipe *o)
+{
+    pthread_mutex_lock(&o->mutex);
+    o->closing = true;
+    pthread_cond_signal(&o->more);
+    pthread_mutex_unlock(&o->mutex);
+    pthread_join(o->feeder, NULL);
+    pthread_join(o->compressor, NULL);
+    if (o->zfailed || o->werrno)
+	outpipe_die(o);
+    if (close(o->fd) < 0)
+	die("%s: %m", o->name);
+    pthread_mutex_destroy(&o->mutex);
+    pthread_cond_destroy(&o->more);
+    pthread_cond_destroy(&o->room);
+    free(o);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,42 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// The output stage of pkglist/srclist generation.  Header blobs are queued
+// and then written, on behalf of the feeder thread, into a pipe.  On the other
+// end of the pipe, the compressor thread runs zpkglistCompress, which writes
+// the compressed output to the file.  Thus compression overlaps with reading
+// the headers, and the caller is not blocked unless the queue is full.
+
+// Start the output stage which will write to fd (e.g. base/srclist.comp.zst).
+// The name is only used in error messages.
+struct outpipe *outpipe_open(int fd, const char *name);
+
+// Queue a header blob for output.  With own, ownership over the malloc'd
+// blob is transferred (it will be freed once written).  Otherwise, the blob
+// must stay valid until outpipe_close (e.g. it points into the PREVOUT_MMAP
+// mapping).
+void outpipe_put(struct outpipe *o, void *blob, size_t blobSize, bool own);
+
+// Flush the queue, wait for the compressor to finish, and close fd.
+// Dies on error.
+void outpipe_close(struct outpipe *o);
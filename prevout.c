@@ -22,6 +22,9 @@
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <zpkglist.h>
 #include <rpm/rpmlib.h>
@@ -29,22 +32,50 @@
 #include "errexit.h"
 #include "prevout.h"
 
+// The number of parsed headers the reader thread can run ahead.
+#define RING 64
+
 struct prevout {
     struct prevhdr h;
     struct zpkglistReader *z;
     bool has, eof;
+    // The stream is decompressed by the reader thread, which fills the ring
+    // of parsed headers ahead of prevout_next, indexed with rhead and rtail
+    // mod RING.  The consumer waits for more headers, and the reader waits
+    // for the room in the ring.
+    pthread_t reader;
+    bool running, stop, reof;
+    pthread_mutex_t mutex;
+    pthread_cond_t more, room;
+    size_t rhead, rtail;
+    struct prevhdr ring[RING];
+    // With PREVOUT_INDEX, the headers are stored in hh[] (a taken header
+    // has its blob set to NULL), and htab[] is the open addressing hash
+    // table which stores indexes into hh[] + 1 (0 means empty slot).
+    struct prevhdr *hh;
+    size_t nh;
+    unsigned *htab;
+    size_t hmask;
+    // The header returned by prevout_find_pkg from the index.
+    struct prevhdr ih;
+    // With PREVOUT_MMAP, hh[] is also loaded, and its blobs point into
+    // the mapping.  Once hh[] is loaded, either way, the stream is closed
+    // (z is NULL), and prevout_next iterates hh[] with pos.
+    char *map;
+    size_t mapSize;
+    size_t pos;
     char from[];
 };
 
 // Parse the blob and fill its credentials.
-static void prevout_parse(struct prevout *p)
+static void prevout_parse1(struct prevhdr *h, const char *from)
 {
-    unsigned il = ntohl(*((unsigned *) p->h.blob + 0));
-    unsigned dl = ntohl(*((unsigned *) p->h.blob + 1));
-    assert(8 + 16 * il + dl == p->h.blobSize);
+    unsigned il = ntohl(*((unsigned *) h->blob + 0));
+    unsigned dl = ntohl(*((unsigned *) h->blob + 1));
+    assert(8 + 16 * il + dl == h->blobSize);
     // The blob starts with these "index entries", followed by data.
     struct ent { int tag; int type; int off; int cnt; };
-    struct ent *begin = (void *) ((char *) p->h.blob + 8);
+    struct ent *begin = (void *) ((char *) h->blob + 8);
     struct ent *end = begin + il;
     // The blob entries are sorted by tag value, and CRPPMTAG tags have
     // the highest values.  The first among them is CRPPMTAG_FILENAME,
@@ -54,13 +85,13 @@ static void prevout_parse(struct prevout *p)
 	if (e->tag == htonl(CRPMTAG_FILENAME))
 	    break;
     if (e == end)
-	die("%s: cannot find CRPMTAG_FILENAME", p->from);
+	die("%s: cannot find CRPMTAG_FILENAME", from);
     // CRPMTAG_FILENAME
     assert(e->type == htonl(RPM_STRING_TYPE));
     int fnamePos = ntohl(e->off);
     assert(fnamePos >= 0);
     assert(fnamePos < dl);
-    p->h.rpm = (const char *) end + fnamePos;
+    h->rpm = (const char *) end + fnamePos;
     // CRPMTAG_FILESIZE
     e++;
     assert(e < end);
@@ -70,8 +101,31 @@ static void prevout_parse(struct prevout *p)
     int fsizePos = ntohl(e->off);
     assert(fnamePos >= 0);
     assert(fnamePos < dl);
-    memcpy(&p->h.fsize, (char *) (begin + il) + fsizePos, 4);
-    p->h.fsize = ntohl(p->h.fsize);
+    memcpy(&h->fsize, (char *) (begin + il) + fsizePos, 4);
+    h->fsize = ntohl(h->fsize);
+    // CRPMTAG_MD5, then possibly CRPMTAG_SHA256.
+    e++;
+    assert(e < end);
+    assert(e->tag == htonl(CRPMTAG_MD5));
+    assert(e->type == htonl(RPM_STRING_TYPE));
+    int md5Pos = ntohl(e->off);
+    assert(md5Pos >= 0);
+    assert(md5Pos < dl);
+    h->md5 = (const char *) end + md5Pos;
+    e++;
+    h->sha256 = e < end && e->tag == htonl(CRPMTAG_SHA256);
+    h->sha = NULL;
+    if (h->sha256) {
+	int shaPos = ntohl(e->off);
+	assert(shaPos >= 0);
+	assert(shaPos < dl);
+	h->sha = (const char *) end + shaPos;
+    }
+}
+
+static inline void prevout_parse(struct prevout *p)
+{
+    prevout_parse1(&p->h, p->from);
 }
 
 static void zdie(const char *from, const char *func, const char *err[2])
@@ -82,12 +136,102 @@ static void zdie(const char *from, const char *func, const char *err[2])
 	die("%s: %s: %s: %s", from, func, err[0], err[1]);
 }
 
-struct prevout *prevout_open(const char *from)
+#include <t1ha.h>
+
+static inline size_t hashName(const char *rpm)
+{
+    return t1ha0(rpm, strlen(rpm), 0);
+}
+
+static void *prevout_reader(void *arg)
+{
+    struct prevout *p = arg;
+    const char *err[2];
+    pthread_mutex_lock(&p->mutex);
+    while (1) {
+	while (p->rtail - p->rhead == RING && !p->stop)
+	    pthread_cond_wait(&p->room, &p->mutex);
+	if (p->stop)
+	    break;
+	pthread_mutex_unlock(&p->mutex);
+	// Errors are handled right here, since the program dies anyway.
+	struct prevhdr h;
+	ssize_t blobSize = zpkglistNextMalloc(p->z, &h.blob, NULL, false, err);
+	if (blobSize < 0)
+	    zdie(p->from, "zpkglistNextMalloc", err);
+	if (blobSize > 0) {
+	    h.blobSize = blobSize;
+	    prevout_parse1(&h, p->from);
+	}
+	pthread_mutex_lock(&p->mutex);
+	if (blobSize == 0) {
+	    p->reof = true;
+	    pthread_cond_signal(&p->more);
+	    break;
+	}
+	p->ring[p->rtail++ % RING] = h;
+	pthread_cond_signal(&p->more);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+static void prevout_start(struct prevout *p)
+{
+    assert(!p->running);
+    p->rhead = p->rtail = 0;
+    p->stop = p->reof = false;
+    int rc = pthread_create(&p->reader, NULL, prevout_reader, p);
+    if (rc)
+	die("%s: %s", "pthread_create", strerror(rc));
+    p->running = true;
+}
+
+// Stop the reader thread and discard the headers it has read ahead.
+static void prevout_stop(struct prevout *p)
+{
+    if (!p->running)
+	return;
+    pthread_mutex_lock(&p->mutex);
+    p->stop = true;
+    pthread_cond_signal(&p->room);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->reader, NULL);
+    p->running = false;
+    for (; p->rhead != p->rtail; p->rhead++)
+	free(p->ring[p->rhead % RING].blob);
+}
+
+// Retrieve the next header from the ring into p->h.
+static bool prevout_pop(struct prevout *p)
+{
+    pthread_mutex_lock(&p->mutex);
+    while (p->rhead == p->rtail && !p->reof)
+	pthread_cond_wait(&p->more, &p->mutex);
+    bool got = p->rhead != p->rtail;
+    if (got) {
+	p->h = p->ring[p->rhead++ % RING];
+	pthread_cond_signal(&p->room);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return got;
+}
+
+static struct prevout *prevout_map(const char *from, int fd);
+static void prevout_index(struct prevout *p);
+
+struct prevout *prevout_open(const char *from, int flags)
 {
     // Open pkglist.
     int fd = open(from, O_RDONLY);
     if (fd < 0)
 	die("%s: %m", from);
+    if (flags & PREVOUT_MMAP) {
+	struct prevout *p = prevout_map(from, fd);
+	if (p && (flags & PREVOUT_INDEX))
+	    prevout_index(p);
+	return p;
+    }
     // Feed it to zpkglistReader.
     struct zpkglistReader *z;
     const char *err[2];
@@ -99,9 +243,9 @@ struct prevout *prevout_open(const char *from)
     // Try to read the first blob.
     void *blob;
     ssize_t blobSize = zpkglistNextMalloc(z, &blob, NULL, false, err);
-    if (rc < 0)
+    if (blobSize < 0)
 	zdie(from, "zpkglistNextMalloc", err);
-    if (rc == 0)
+    if (blobSize == 0)
 	return warn("%s: empty input", from), zpkglistClose(z), NULL;
     // Allocate the structure.
     size_t len = strlen(from);
@@ -113,28 +257,180 @@ struct prevout *prevout_open(const char *from)
     prevout_parse(p);
     p->has = true;
     p->eof = false;
+    p->hh = NULL;
+    p->nh = 0;
+    p->htab = NULL;
+    p->map = NULL;
+    // Further headers will be read in the background.
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->more, NULL);
+    pthread_cond_init(&p->room, NULL);
+    p->running = false;
+    prevout_start(p);
+    if (flags & PREVOUT_INDEX)
+	prevout_index(p);
     return p;
 }
 
+// Append a header to hh[].
+static void prevout_push(struct prevout *p, struct prevhdr *h, size_t *alloc)
+{
+    if (p->nh == *alloc) {
+	*alloc = *alloc ? 2 * *alloc : 1024;
+	p->hh = xrealloc(p->hh, *alloc * sizeof *p->hh);
+    }
+    p->hh[p->nh++] = *h;
+}
+
+// Each header on the list is preceded by the header magic.
+static const unsigned char magic[8] = { 0x8e, 0xad, 0xe8, 0x01, 0, 0, 0, 0 };
+
+// Decompress the whole list into a memfd, which is then mapped, and parse
+// the headers in place.  Returns NULL on empty input.
+static struct prevout *prevout_map(const char *from, int fd)
+{
+    int memfd = memfd_create("prevout", MFD_CLOEXEC);
+    if (memfd < 0)
+	die("%s: %m", "memfd_create");
+    const char *err[2];
+    if (zpkglistDecompress(fd, memfd, err, NULL, NULL) < 0)
+	zdie(from, "zpkglistDecompress", err);
+    close(fd);
+    struct stat st;
+    if (fstat(memfd, &st) < 0)
+	die("%s: %m", "fstat");
+    size_t mapSize = st.st_size;
+    if (mapSize == 0)
+	return warn("%s: empty input", from), close(memfd), NULL;
+    // The mapping is shared, so that writes (e.g. stripping the file lists)
+    // do not incur copy-on-write.
+    char *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED)
+	die("%s: %m", "mmap");
+    close(memfd);
+    size_t len = strlen(from);
+    struct prevout *p = xmalloc(sizeof *p + len + 1);
+    memcpy(p->from, from, len + 1);
+    p->z = NULL;
+    p->hh = NULL;
+    p->nh = 0;
+    p->htab = NULL;
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->more, NULL);
+    pthread_cond_init(&p->room, NULL);
+    p->running = false;
+    size_t alloc = 0;
+    size_t off = 0;
+    while (off < mapSize) {
+	if (mapSize - off < sizeof magic + 8 || memcmp(map + off, magic, sizeof magic))
+	    die("%s: bad header magic", from);
+	off += sizeof magic;
+	unsigned ildl[2];
+	memcpy(ildl, map + off, 8);
+	unsigned il = ntohl(ildl[0]);
+	unsigned dl = ntohl(ildl[1]);
+	if (il > (mapSize - off - 8) / 16 || dl > mapSize - off - 8 - 16 * il)
+	    die("%s: bad header size", from);
+	size_t blobSize = 8 + 16 * il + dl;
+	// Blobs must be aligned at least to RPM_INT32_TYPE, as if they
+	// were malloc'd.  An unaligned blob is moved down by a few bytes,
+	// into the magic which precedes it.
+	char *blob = map + (off & ~(size_t) 3);
+	if (blob != map + off)
+	    memmove(blob, map + off, blobSize);
+	struct prevhdr h;
+	h.blob = blob;
+	h.blobSize = blobSize;
+	prevout_parse1(&h, from);
+	prevout_push(p, &h, &alloc);
+	off += blobSize;
+    }
+    p->map = map;
+    p->mapSize = mapSize;
+    p->pos = 0;
+    p->has = p->eof = false;
+    return p;
+}
+
+// Load all the headers and build the index.
+static void prevout_index(struct prevout *p)
+{
+    if (!p->map) {
+	size_t alloc = 0;
+	struct prevhdr *h;
+	while ((h = prevout_next(p)))
+	    prevout_push(p, h, &alloc);
+    }
+    // Load factor at most 1/2.
+    size_t hsize = 2;
+    while (hsize < 2 * p->nh)
+	hsize *= 2;
+    p->htab = xmalloc(hsize * sizeof *p->htab);
+    memset(p->htab, 0, hsize * sizeof *p->htab);
+    p->hmask = hsize - 1;
+    for (size_t i = 0; i < p->nh; i++) {
+	size_t j = hashName(p->hh[i].rpm) & p->hmask;
+	while (p->htab[j]) {
+	    if (strcmp(p->hh[p->htab[j]-1].rpm, p->hh[i].rpm) == 0)
+		die("%s: %s: duplicate CRPMTAG_FILENAME", p->from, p->hh[i].rpm);
+	    j = (j + 1) & p->hmask;
+	}
+	p->htab[j] = i + 1;
+    }
+    // The blobs now belong to the index, and prevout_next starts over
+    // with hh[] rather than decompressing the stream again.
+    if (!p->map) {
+	prevout_stop(p);
+	zpkglistClose(p->z);
+	p->z = NULL;
+	p->pos = 0;
+	p->has = p->eof = false;
+    }
+}
+
 void prevout_close(struct prevout *p)
 {
     if (!p)
 	return;
-    zpkglistClose(p->z);
-    if (p->has)
-	free(p->h.blob);
+    if (p->map)
+	munmap(p->map, p->mapSize);
+    else {
+	if (p->z) {
+	    prevout_stop(p);
+	    zpkglistClose(p->z);
+	}
+	if (p->has)
+	    free(p->h.blob);
+	for (size_t i = 0; i < p->nh; i++)
+	    free(p->hh[i].blob);
+    }
+    free(p->hh);
+    free(p->htab);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->more);
+    pthread_cond_destroy(&p->room);
     free(p);
 }
 
 void prevout_rewind(struct prevout *p)
 {
+    if (!p->z) {
+	if (p->has && !p->map)
+	    free(p->h.blob);
+	p->pos = 0;
+	p->has = p->eof = false;
+	return;
+    }
     const char *err[2];
     if (p->has) {
 	p->has = false;
 	free(p->h.blob);
     }
+    prevout_stop(p);
     if (!zpkglistRewind(p->z, err))
 	zdie(p->from, "zpkglistRewind", err);
+    p->eof = false;
+    prevout_start(p);
 }
 
 struct prevhdr *prevout_next(struct prevout *p)
@@ -145,14 +441,20 @@ struct prevhdr *prevout_next(struct prevout *p)
 	p->has = false;
 	return &p->h;
     }
-    const char *err[2];
-    ssize_t blobSize = zpkglistNextMalloc(p->z, &p->h.blob, NULL, false, err);
-    if (blobSize < 0)
-	zdie(p->from, "zpkglistNextMalloc", err);
-    if (blobSize == 0)
+    if (!p->z) {
+	// Taken headers are skipped.
+	while (p->pos < p->nh && !p->hh[p->pos].blob)
+	    p->pos++;
+	if (p->pos == p->nh)
+	    return p->eof = true, NULL;
+	p->h = p->hh[p->pos++];
+	// Unless mapped, the blob is handed over to the caller.
+	if (!p->map)
+	    p->hh[p->pos-1].blob = NULL;
+	return &p->h;
+    }
+    if (!prevout_pop(p))
 	return p->eof = true, NULL;
-    p->h.blobSize = blobSize;
-    prevout_parse(p);
     return &p->h;
 }
 
@@ -169,7 +471,8 @@ static inline struct prevhdr *prevout_find(struct prevout *p, const char *rpm, b
 	    p->has = true;
 	    return NULL;
 	}
-	free(h->blob);
+	if (!p->map)
+	    free(h->blob);
     }
 }
 
@@ -180,7 +483,22 @@ struct prevhdr *prevout_find_src(struct prevout *p, const char *rpm)
 
 struct prevhdr *prevout_find_pkg(struct prevout *p, const char *rpm)
 {
-    return prevout_find(p, rpm, false);
+    if (!p->htab)
+	return prevout_find(p, rpm, false);
+    size_t j = hashName(rpm) & p->hmask;
+    while (p->htab[j]) {
+	struct prevhdr *h = &p->hh[p->htab[j]-1];
+	// Taken headers are skipped, their names are gone with the blobs.
+	// Mapped headers are never taken.
+	if (h->blob && strcmp(h->rpm, rpm) == 0) {
+	    p->ih = *h;
+	    if (!p->map)
+		h->blob = NULL;
+	    return &p->ih;
+	}
+	j = (j + 1) & p->hmask;
+    }
+    return NULL;
 }
 
 // ex:set ts=8 sts=4 sw=4 noet:
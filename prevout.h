@@ -18,6 +18,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <stdbool.h>
+
 // The previous output written by genpkglist/gensrclist can be reused as a
 // cache for the next run of the program - that is, most of the headers can
 // be picked up from the existing pkglist/srclist rather than re-read from
@@ -56,17 +58,36 @@ struct prevhdr {
     // the malloc'd blob is transferred to the caller.  The caller should
     // typically either load the blob with headerImport (which will retake
     // ownership) or free the blob - eventually, not necessarily before
-    // retrieving the next blob.
+    // retrieving the next blob.  (PREVOUT_MMAP is different, see below.)
     void *blob;
     size_t blobSize;
     // Header credentials, as discussed above.
     const char *rpm; // CRPMTAG_FILENAME, points somewhere into the blob.
     unsigned fsize; // CRPMTAG_FILESIZE
+    bool sha256; // whether CRPMTAG_SHA256 is present
+    const char *md5; // CRPMTAG_MD5, hex
+    const char *sha; // CRPMTAG_SHA256, hex, or NULL
 };
 
 // Create a handle for the previous output.
 // Dies on error, returns NULL on empty, er, input.
-struct prevout *prevout_open(const char *from);
+struct prevout *prevout_open(const char *from, int flags);
+
+// With this flag, all the headers are loaded upfront, and an index
+// by CRPMTAG_FILENAME is built, so that prevout_find_pkg works in O(1),
+// regardless of the order in which packages are looked up.  The stream
+// is then decompressed only once: prevout_next iterates the loaded headers,
+// skipping those already taken with prevout_find_pkg (and vice versa).
+#define PREVOUT_INDEX 1
+
+// With this flag, the previous output is decompressed only once, straight
+// into a memfd mapping, and the blobs exposed through prevhdr point into
+// the mapping (there is no per-header malloc).  The ownership over the blobs
+// is NOT transferred to the caller: the blobs must not be freed, and they
+// stay valid until prevout_close.  The blobs are writable, e.g. the file list
+// can be stripped in place, but then the changes will be seen after
+// prevout_rewind, which otherwise costs nothing.
+#define PREVOUT_MMAP 2
 void prevout_close(struct prevout *p);
 
 // It is possible to implement two-pass algorithms.
@@ -82,5 +103,7 @@ struct prevhdr *prevout_find_src(struct prevout *p, const char *rpm);
 
 // In pkglists, headers are grouped by src.rpm.  Sorting them out requires
 // a separate first pass.  This function implements "unbounded search" for
-// the second pass.
+// the second pass.  With PREVOUT_INDEX, it looks up the index instead, and
+// does not affect the iteration with prevout_next.  Each indexed header can
+// only be retrieved once, since the ownership over the blob is transferred.
 struct prevhdr *prevout_find_pkg(struct prevout *p, const char *rpm);
@@ -0,0 +1,202 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <rpm/rpmlib.h>
+#include "crpmtag.h"
+#include "errexit.h"
+#include "projblob.h"
+
+// Raw header entry, network byte order.
+struct ent { int tag, type, off, cnt; };
+
+// A source entry picked for the output, along with its data.
+struct pick {
+    int tag; // host byte order, for sorting
+    const struct ent *e;
+    const char *src;
+    unsigned len;
+    unsigned align;
+};
+
+// Determine the data size and alignment of a source entry, the way
+// librpm's dataLength() does, only without trusting the source blob.
+static bool dataLength(struct pick *p, const char *data, unsigned dl)
+{
+    unsigned off = ntohl(p->e->off);
+    unsigned cnt = ntohl(p->e->cnt);
+    if (off >= dl || cnt == 0)
+	return false;
+    p->src = data + off;
+    unsigned avail = dl - off;
+    unsigned size;
+    switch (ntohl(p->e->type)) {
+    case RPM_CHAR_TYPE:
+    case RPM_INT8_TYPE:
+    case RPM_BIN_TYPE:
+	size = 1; break;
+    case RPM_INT16_TYPE:
+	size = 2; break;
+    case RPM_INT32_TYPE:
+	size = 4; break;
+    case RPM_INT64_TYPE:
+	size = 8; break;
+    case RPM_STRING_TYPE:
+	if (cnt != 1)
+	    return false;
+	// fall through
+    case RPM_STRING_ARRAY_TYPE:
+    case RPM_I18NSTRING_TYPE: {
+	// Strings are not aligned.
+	p->align = 1;
+	const char *s = p->src, *end = p->src + avail;
+	for (unsigned i = 0; i < cnt; i++) {
+	    const char *z = memchr(s, '\0', end - s);
+	    if (!z)
+		return false;
+	    s = z + 1;
+	}
+	p->len = s - p->src;
+	return true;
+    }
+    default:
+	return false;
+    }
+    if (cnt > avail / size)
+	return false;
+    p->len = cnt * size;
+    p->align = size;
+    return true;
+}
+
+// Pad dl with null bytes to the alignment boundary (p can be NULL when
+// just counting the size).
+static inline unsigned alignData(char *p, unsigned dl, unsigned align)
+{
+    unsigned diff = (align - dl % align) % align;
+    if (p)
+	memset(p + dl, 0, diff);
+    return dl + diff;
+}
+
+void *projectBlob(const void *blob, size_t blobSize,
+		  const int tags[], size_t ntag,
+		  const struct blobcred *cred, size_t *sizep)
+{
+    if (blobSize < 8)
+	return NULL;
+    unsigned il = ntohl(*((unsigned *) blob + 0));
+    unsigned dl = ntohl(*((unsigned *) blob + 1));
+    if (il > (blobSize - 8) / 16 || 8 + 16 * il + dl != blobSize)
+	return NULL;
+    // The blob starts with these "index entries", followed by data.
+    const struct ent *ee = (const void *) ((const char *) blob + 8);
+    const char *data = (const char *) (ee + il);
+    // Pick the entries.  The tags[] array is short, and the source blob
+    // has a few dozen entries, so the nested loop is just fine.
+    struct pick pp[ntag + 1];
+    size_t npick = 0;
+    for (const struct ent *e = ee; e < ee + il; e++) {
+	int tag = ntohl(e->tag);
+	for (size_t i = 0; i < ntag; i++) {
+	    if (tags[i] != tag)
+		continue;
+	    // Duplicate tags would be confusing.
+	    if (npick == ntag)
+		return NULL;
+	    struct pick *p = &pp[npick++];
+	    p->tag = tag, p->e = e;
+	    if (!dataLength(p, data, dl))
+		return NULL;
+	    break;
+	}
+    }
+    // In the output, the entries are sorted by tag, and so is the data
+    // (headerExport lays out the data in the order of entries, which,
+    // for the entries added with headerPut, is the tag order).
+    for (size_t i = 1; i < npick; i++)
+	for (size_t j = i; j > 0 && pp[j].tag < pp[j-1].tag; j--) {
+	    struct pick tmp = pp[j];
+	    pp[j] = pp[j-1], pp[j-1] = tmp;
+	}
+    for (size_t i = 1; i < npick; i++)
+	if (pp[i].tag == pp[i-1].tag)
+	    return NULL;
+    // CRPMTAG entries go last.
+    assert(npick == 0 || pp[npick-1].tag < CRPMTAG_FILENAME);
+    // Credentials, in the tag order.
+    size_t fnameLen = strlen(cred->rpm) + 1;
+    size_t md5Len = strlen(cred->md5) + 1;
+    size_t shaLen = cred->sha256 ? strlen(cred->sha256) + 1 : 0;
+    size_t dirLen = strlen(cred->dir) + 1;
+    // Calculate the size.
+    unsigned dl2 = 0;
+    for (size_t i = 0; i < npick; i++)
+	dl2 = alignData(NULL, dl2, pp[i].align) + pp[i].len;
+    dl2 += fnameLen;
+    dl2 = alignData(NULL, dl2, 4) + 4;
+    dl2 += md5Len + shaLen + dirLen;
+    unsigned il2 = npick + 4 + !!shaLen;
+    size_t blobSize2 = 8 + 16 * il2 + dl2;
+    // Allocate with the alignment at least to RPM_INT32_TYPE,
+    // which is what stripFileList wants.
+    unsigned *blob2 = xmalloc(blobSize2);
+    blob2[0] = htonl(il2);
+    blob2[1] = htonl(dl2);
+    struct ent *e2 = (void *) (blob2 + 2);
+    char *data2 = (char *) (e2 + il2);
+    // Copy the entries.
+    dl2 = 0;
+    for (size_t i = 0; i < npick; i++, e2++) {
+	dl2 = alignData(data2, dl2, pp[i].align);
+	e2->tag = pp[i].e->tag;
+	e2->type = pp[i].e->type;
+	e2->off = htonl(dl2);
+	e2->cnt = pp[i].e->cnt;
+	memcpy(data2 + dl2, pp[i].src, pp[i].len);
+	dl2 += pp[i].len;
+    }
+    // Append the credentials.
+#define PutEnt(t, ty, c) \
+    e2->tag = htonl(t), e2->type = htonl(ty), \
+    e2->off = htonl(dl2), e2->cnt = htonl(c), e2++
+    PutEnt(CRPMTAG_FILENAME, RPM_STRING_TYPE, 1);
+    memcpy(data2 + dl2, cred->rpm, fnameLen), dl2 += fnameLen;
+    dl2 = alignData(data2, dl2, 4);
+    PutEnt(CRPMTAG_FILESIZE, RPM_INT32_TYPE, 1);
+    unsigned fsize = htonl(cred->fsize);
+    memcpy(data2 + dl2, &fsize, 4), dl2 += 4;
+    PutEnt(CRPMTAG_MD5, RPM_STRING_TYPE, 1);
+    memcpy(data2 + dl2, cred->md5, md5Len), dl2 += md5Len;
+    if (shaLen) {
+	PutEnt(CRPMTAG_SHA256, RPM_STRING_TYPE, 1);
+	memcpy(data2 + dl2, cred->sha256, shaLen), dl2 += shaLen;
+    }
+    PutEnt(CRPMTAG_DIRECTORY, RPM_STRING_TYPE, 1);
+    memcpy(data2 + dl2, cred->dir, dirLen), dl2 += dirLen;
+    assert(8 + 16 * il2 + dl2 == blobSize2);
+    *sizep = blobSize2;
+    return blob2;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
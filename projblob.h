@@ -0,0 +1,40 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stddef.h>
+
+// Package credentials, appended as CRPMTAG entries.
+struct blobcred {
+    const char *dir; // CRPMTAG_DIRECTORY
+    const char *rpm; // CRPMTAG_FILENAME
+    unsigned fsize;  // CRPMTAG_FILESIZE
+    const char *md5; // CRPMTAG_MD5
+    const char *sha256; // CRPMTAG_SHA256, NULL to omit
+};
+
+// Make a new header blob out of the raw header blob read from an rpm file,
+// keeping only the tags[] entries and appending the credentials.  This is
+// what headerNew + copyTag + headerPut + headerExport would do, and the result
+// is byte-for-byte identical, except that the source blob is never loaded
+// with headerImport.  Returns a malloc'd blob, or NULL if the source blob
+// is malformed.
+void *projectBlob(const void *blob, size_t blobSize,
+		  const int tags[], size_t ntag,
+		  const struct blobcred *cred, size_t *sizep);